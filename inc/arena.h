@@ -0,0 +1,51 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Working memory of a machine: the block cache, copy-on-write pages, the
+// picture and frames, and run-ahead shadows. arenaAlloc() takes it from the
+// arena installed on the calling thread, if any, and from the heap
+// otherwise; arenaFree() gives it back from any thread. Arena memory is
+// reused only once the arena is reset, except for the block allocated last,
+// which its own thread hands back at once.
+//
+// Runner gives each worker an arena and resets it between episodes, so
+// that episodes neither go through the shared heap nor fragment it.
+class Arena {
+ private:
+  uint8_t* base_;
+  size_t size_;
+  size_t used_;
+
+ public:
+  // size bytes, allocated up front. Should that fail, every allocation
+  // falls back to the heap.
+  explicit Arena(size_t size);
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  // size bytes, a multiple of 16, 16-byte aligned; nullptr when full.
+  void* alloc(size_t size);
+  // Takes back the block at p if it was allocated last.
+  void release(void* p, size_t size);
+  // Forgets everything allocated. None of it may still be in use, nor be
+  // freed afterwards; the same goes for destroying the arena.
+  void reset() { used_ = 0; }
+  size_t used() const { return used_; }
+  size_t size() const { return size_; }
+};
+
+// Makes arena the one this thread allocates from until the scope ends.
+class ArenaScope {
+ private:
+  Arena* previous_;
+
+ public:
+  explicit ArenaScope(Arena* arena);
+  ~ArenaScope();
+};
+
+// size bytes, 16-byte aligned, uninitialized. Throws std::bad_alloc when
+// the heap is out of memory.
+void* arenaAlloc(size_t size);
+void arenaFree(void* p);
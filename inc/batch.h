@@ -0,0 +1,59 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "gameboy.h"
+#include "rom.h"
+
+// Many machines on one ROM, stepped in lockstep with one call, as for
+// reinforcement learning. The machines sit back to back in one allocation,
+// each on its own cache lines, and observations of all of them go to one
+// array with a fixed stride.
+//
+// What a machine holds outside that block is allocated separately: its
+// CPU block cache (about 290KB, on the first frame), its VRAM and WRAM as
+// 64 copy-on-write pages of 256 bytes, the picture being drawn, HRAM and
+// cartridge RAM. The two RGBA frames (about 180KB) are only allocated with
+// OBS_PICTURE.
+class GameboyBatch {
+ public:
+  enum ObservationFlags {
+    // The last finished picture, see Gameboy::pictureShades().
+    OBS_PICTURE = 1,
+  };
+
+ private:
+  Rom* rom_;
+  int count_;
+  size_t stride_;
+  uint8_t* machines_;
+  std::vector<uint8_t> start_;
+
+  std::vector<uint16_t> ramAddrs_;
+  uint32_t obsFlags_;
+  uint16_t doneAddr_;
+  uint8_t doneMask_;
+  uint8_t doneValue_;
+
+ public:
+  // Takes ownership of a malloc'd ROM image of size bytes, freeing it if it
+  // is rejected. count must be positive. All machines start from the same
+  // power-on state.
+  GameboyBatch(uint8_t* romData, size_t size, int count);
+  ~GameboyBatch();
+  int count() const { return count_; }
+  Gameboy& operator[](int i) { return *reinterpret_cast<Gameboy*>(machines_ + i * stride_); }
+  // Each observation is a done byte, then the byte at each of addrs, then
+  // the picture with OBS_PICTURE.
+  void setObservation(const uint16_t* addrs, int n, uint32_t flags);
+  size_t observationSize() const;
+  // An episode is done once (byte at addr & mask) == value; mask 0 never.
+  void setDone(uint16_t addr, uint8_t mask, uint8_t value);
+  // Runs every machine frames frames holding its joypad byte from actions,
+  // then writes count() observations to out, observationSize() apart.
+  void step(const uint8_t* actions, int frames, uint8_t* out);
+  // Puts machine i back to the power-on state.
+  void reset(int i);
+};
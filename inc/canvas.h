@@ -2,5 +2,6 @@
 // #define IMPORT __attribute__ ((visibility ("default")))
 
 extern "C" {
-extern void renderCanvas(int canvasId, uint8_t* buf);
+// Shows a finished 160x144 frame of 32-bit pixels, see Video::frame().
+extern void renderCanvas(int canvasId, uint8_t* rgba);
 }
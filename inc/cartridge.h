@@ -1,17 +1,110 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
+#include <vector>
+
+#include "rom.h"
+#include "snapshot.h"
+
 class Cartridge {
  private:
-  uint8_t* data_;
+  // Shared with every cartridge running the same image.
+  Rom* rom_;
+  // rom_->data(), for ROM reads.
+  const uint8_t* data_;
+  // Copy-on-write, shared with forks until either side writes it.
   uint8_t* ram_;
   uint8_t* ramBank_;
+  const uint8_t* romBankData_;
+  uint32_t romBank_;
+  Rom::MBC mbc_;
+  uint32_t romBanks_;
+  uint32_t ramBanks_;
+  bool ramEnabled_;
+  // Bank register values as written by the game.
+  uint32_t romBankReg_;
+  uint8_t ramBankReg_;
+  uint8_t mode_;
+  // MBC3 clock registers, selected by RAM bank 0x08-0x0C. The clock does not
+  // run; games see the values they last wrote.
+  uint8_t rtc_[5];
+  // Battery RAM pages written since the last takeDirtyRanges(), one bit per
+  // 256 bytes of ram_.
+  bool battery_;
+  bool ramChanged_;
+  uint64_t ramDirty_[8];
+  int saveFd_;
+
+  uint8_t remapRom_();
+  uint8_t remapRam_();
+  // A fork, see fork().
+  Cartridge(const Cartridge& oth);
 
  public:
-  Cartridge(uint8_t* data);
+  // What a write to a cartridge register changed, see write().
+  enum Remap { REMAP_NONE = 0, REMAP_ROM = 1, REMAP_RAM = 2 };
+
+  // Who releases the ROM image, see Rom::Ownership.
+  typedef Rom::Ownership Ownership;
+  static const Ownership OWNED = Rom::OWNED;
+  static const Ownership MAPPED = Rom::MAPPED;
+  static const Ownership BORROWED = Rom::BORROWED;
+
+  // Takes over a handle from Rom::acquire() or Rom::share().
+  explicit Cartridge(Rom* rom);
+  // Registers the size bytes at data with Rom::acquire(), which may drop
+  // them for a copy registered already.
+  Cartridge(const uint8_t* data, size_t size, Ownership ownership = OWNED);
   Cartridge(Cartridge&& oth);
+#ifndef __EMSCRIPTEN__
+  // Maps a ROM file read-only, see Rom::mapFile(). Every cartridge mapping
+  // the same file shares its physical pages.
+  static Cartridge mapFile(const char* path);
+#endif
   ~Cartridge();
-  uint8_t& ram(uint16_t addr);
-  uint8_t rom(uint16_t addr);
+  // A copy in the same state that shares the ROM image, and RAM until
+  // either cartridge writes it. It has no save file and no unsaved changes.
+  Cartridge fork() const;
+  uint8_t readRam(uint16_t addr);
+  void writeRam(uint16_t addr, uint8_t datum);
+  // Clean pages of battery RAM are mapped read-only so that the first write
+  // to each reaches writeRam() and marks it dirty; dirty pages are writable.
+  // RAM shared with a fork is read-only until ownRam().
+  bool ramPageWritable(uint16_t addr) const;
+  // Takes a private copy of RAM shared with a fork. The RAM window must be
+  // remapped afterwards.
+  void ownRam();
+  uint8_t rom(uint16_t addr) {
+    return addr < 0x4000 ? data_[addr] : romBankData_[addr - 0x4000];
+  }
+  // Host memory behind the 16KB ROM window at addr (0x0000 or 0x4000), and
+  // behind 0xA000-0xBFFF, or nullptr when cartridge RAM is not accessible.
+  const uint8_t* romData(uint16_t addr) { return addr < 0x4000 ? data_ : romBankData_; }
+  uint8_t* ramData() { return ramEnabled_ ? ramBank_ : nullptr; }
+  // Bank mapped at 0x4000-0x7FFF.
+  const uint32_t& romBank() const { return romBank_; }
+  // Header and global checksums, which tell ROMs apart.
+  uint32_t checksum() const { return rom_->checksum(); }
+  bool hasBattery() const { return battery_; }
+  // Read-only while shared with a fork, see ownRam().
+  uint8_t* saveRam() { return ram_; }
+  size_t saveRamSize() const { return ramBanks_ * 0x2000; }
+  // Whether battery RAM changed since the last takeDirtyRanges().
+  bool saveDirty() const { return ramChanged_; }
+  // Appends an (offset, length) pair for each run of dirty battery RAM to
+  // ranges and marks it clean. The RAM window must be remapped afterwards.
+  void takeDirtyRanges(std::vector<uint32_t>* ranges);
+#ifndef __EMSCRIPTEN__
+  // Loads battery RAM from path, creating the file if needed, and keeps it
+  // open for writeSave().
+  void openSaveFile(const char* path);
+  void writeSave(const std::vector<uint32_t>& ranges);
+#endif
+  // Bank registers and RAM. Loading reports pages that differ from the
+  // current RAM as dirty; the caller must remap both windows afterwards.
+  void serialize(Snapshot* state);
+  // Writes a bank controller register. Returns the Remap bits of the
+  // windows whose host memory changed.
   uint8_t write(uint16_t addr, uint8_t datum);
-};
\ No newline at end of file
+};
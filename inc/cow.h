@@ -0,0 +1,69 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#include <atomic>
+#include <cstring>
+#include <new>
+
+// Copy-on-write buffers shared by a machine and its forks, see
+// Gameboy::fork(). Each buffer is preceded by its reference count. A holder
+// writes to a buffer only while it holds the only reference, and takes a
+// private copy with cowOwn() otherwise. Counts are atomic so that forks can
+// run on other threads than their parent. Buffers come from arenaAlloc().
+struct CowHeader {
+  std::atomic<uint32_t> refs;
+  uint32_t size;
+};
+// Keeps the data 16-byte aligned.
+const size_t COW_HEADER_SIZE = 16;
+
+inline CowHeader* cowHeader(const uint8_t* buf) {
+  return reinterpret_cast<CowHeader*>(const_cast<uint8_t*>(buf) - COW_HEADER_SIZE);
+}
+
+// A zeroed buffer with a single reference.
+inline uint8_t* cowAlloc(size_t size) {
+  uint8_t* block = static_cast<uint8_t*>(arenaAlloc(COW_HEADER_SIZE + size));
+  CowHeader* header = new (block) CowHeader;
+  header->refs.store(1, std::memory_order_relaxed);
+  header->size = size;
+  memset(block + COW_HEADER_SIZE, 0, size);
+  return block + COW_HEADER_SIZE;
+}
+
+inline uint8_t* cowShare(uint8_t* buf) {
+  cowHeader(buf)->refs.fetch_add(1, std::memory_order_relaxed);
+  return buf;
+}
+
+inline void cowRelease(uint8_t* buf) {
+  if (buf == nullptr)
+    return;
+  CowHeader* header = cowHeader(buf);
+  if (header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    header->~CowHeader();
+    arenaFree(buf - COW_HEADER_SIZE);
+  }
+}
+
+inline bool cowShared(const uint8_t* buf) {
+  return cowHeader(buf)->refs.load(std::memory_order_acquire) > 1;
+}
+
+// buf when it is not shared, else a private copy that takes the place of the
+// caller's reference.
+inline uint8_t* cowOwn(uint8_t* buf) {
+  if (!cowShared(buf))
+    return buf;
+  size_t size = cowHeader(buf)->size;
+  uint8_t* copy = static_cast<uint8_t*>(arenaAlloc(COW_HEADER_SIZE + size));
+  CowHeader* header = new (copy) CowHeader;
+  header->refs.store(1, std::memory_order_relaxed);
+  header->size = size;
+  memcpy(copy + COW_HEADER_SIZE, buf, size);
+  cowRelease(buf);
+  return copy + COW_HEADER_SIZE;
+}
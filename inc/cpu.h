@@ -2,6 +2,7 @@
 #include <stdint.h>
 
 #include "memory.h"
+#include "snapshot.h"
 
 class CPU {
  public:
@@ -41,11 +42,82 @@ class CPU {
 
   Memory* mem_;
 
-  int executeCBInst_(uint8_t op);
+  enum FlagOp {
+    FLAGS_NONE,
+    FLAGS_ADD,
+    FLAGS_SUB,
+    FLAGS_AND,
+    FLAGS_LOGIC,
+    FLAGS_INC,
+    FLAGS_DEC,
+    FLAGS_SHIFT,
+    FLAGS_BIT,
+  };
+  // Condition flags are evaluated lazily: ALU ops only record their kind,
+  // operands and result, and flags() produces reg_.f when it is read.
+  // reg_.f is up to date only while op is FLAGS_NONE.
+  struct LazyFlags {
+    uint8_t op;
+    uint8_t x;
+    uint8_t y;
+    uint8_t r;
+    uint8_t c;
+  } lazyFlags_;
+
+  uint8_t flags();
+  uint8_t carry();
+  void setFlags(uint8_t f);
+  void setLazyFlags(uint8_t op, uint8_t x, uint8_t y, uint8_t r, uint8_t c);
+
+  // Predecoded straight-line code. Each entry already carries its handler
+  // and immediate operand, so running it needs no fetch and no decode.
+  struct DecodedInst {
+    int (*inst)(CPU* cpu);
+    uint16_t pc;
+    uint16_t imm;
+    uint8_t len;
+  };
+  static const int BLOCK_SLOTS = 1024;
+  static const int BLOCK_INSTS = 16;
+  struct Block {
+    uint32_t key;         // ROM bank << 16 | start pc
+    const uint32_t* tag;  // Memory::codeTag of the block
+    uint32_t tagValue;    // and its value when the block was decoded
+    uint8_t size;
+    bool idleLoop;  // reads memory only and branches back to its start
+    DecodedInst insts[BLOCK_INSTS];
+  };
+
+  enum State { RUNNING, HALTED, STOPPED };
+  State state_;
+
+  // Immediate operand of the instruction being executed.
+  uint16_t imm_;
+  // Direct-mapped cache of decoded blocks, allocated on first use.
+  Block* blocks_;
+  Block* block_;
+  int blockIdx_;
+  DecodedInst scratch_;
+
+  // Idle loop detection, see checkIdleLoop_().
+  int passCycles_;
+  uint32_t passEvents_;
+  int idleLoop_;
+  Register idleRegs_;
+
+  void decodeInst_(uint16_t pc, DecodedInst* out);
+  Block* lookupBlock_(uint16_t pc);
   int executeSingleInstInner_();
-  int stop_();
+  void checkIdleLoop_();
 
  public:
   CPU(Memory* mem);
+  ~CPU();
   int executeSingleInst();
+  // Whether the CPU sits in HALT or STOP, waiting for an interrupt.
+  bool halted() const { return state_ != RUNNING; }
+  // Cycles per iteration when the last instruction closed a side-effect-free
+  // polling loop that will repeat unchanged until the next event, else 0.
+  int idleLoopCycles() const { return idleLoop_; }
+  void serialize(Snapshot* state);
 };
\ No newline at end of file
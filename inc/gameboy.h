@@ -2,25 +2,146 @@
 #include "cpu.h"
 #include "io.h"
 #include "memory.h"
+#include "rewind.h"
+#include "scheduler.h"
 #include "timer.h"
 #include "video.h"
 
 #include <stdint.h>
 
+#include <vector>
+
 class Gameboy {
  private:
+  Scheduler sched_;
   IO io_;
   Memory mem_;
   Video video_;
   Timer timer_;
   CPU cpu_;
   bool isRunning_;
-  int timing_;
+  uint64_t frameEnd_;
+  uint64_t idleCycles_;
+  std::vector<uint32_t> saveRanges_;
+  Rewind* rewind_;
+  std::vector<uint8_t> checkpoint_;
+  // Frame skip controller, see setFrameSkip().
+  int maxSkip_;
+  int skip_;
+  double skipBudget_;
+  double frameTime_;
+  int framesSinceSkipChange_;
+  // Whether setHeadless() is on, and the frame skip settings it replaced.
+  bool headless_;
+  int shownMaxSkip_;
+  double shownSkipBudget_;
+
+  void updateFrameSkip_(double ms);
+  void pushRewind_();
+
+  void runFrame_(uint8_t joypad);
+  void serialize_(Snapshot* state);
+  // See fork().
+  explicit Gameboy(Gameboy* parent);
 
  public:
-  Gameboy(uint8_t* romData, int canvasId);
+  // Takes ownership of a malloc'd ROM image of size bytes. If another
+  // instance runs the same image, romData is freed and that copy shared; see
+  // Rom::acquire(). It is freed too if it is rejected.
+  Gameboy(uint8_t* romData, size_t size, int canvasId);
+  Gameboy(Cartridge&& cart, int canvasId);
+  ~Gameboy();
   bool run();
   // bool pause();
   // bool stop();
   void executeSingleFrame(uint8_t joypad);
+  // What executeFrames() takes from inputs and records after each frame.
+  enum ExecFlags {
+    // inputs is a single joypad byte held for every frame, not one per frame.
+    EXEC_HOLD_INPUT = 1,
+    // The 64-bit hash of the last finished picture.
+    EXEC_HASH = 2,
+    // A copy of the 8KB of work RAM.
+    EXEC_WRAM = 4,
+    // Shows the last picture of the batch on the canvas; nothing else is.
+    EXEC_SHOW_LAST = 8,
+    // Leaves the last finished picture in frame() without showing it.
+    EXEC_KEEP_LAST = 16,
+    // The last finished picture as 160x144 shades, see pictureShades(). Every
+    // picture is then drawn; to record only selected frames, run the others
+    // in calls without this flag.
+    EXEC_PICTURE = 32,
+  };
+  // Bytes executeFrames() records per frame with the given flags.
+  static size_t frameRecordSize(uint32_t flags);
+  // Runs up to n frames with the joypad schedule in inputs, writing a record
+  // per frame to out, and returns how many frames ran: fewer than n when out
+  // only has room for that many. renderCanvas is called at most once.
+  int executeFrames(int n, const uint8_t* inputs, uint32_t flags, uint8_t* out, size_t size);
+  // Runs one frame, then frames more with the same input whose last picture
+  // is shown, and goes back to the end of the first one. Hides that many
+  // frames of the game's own input lag.
+  void runAhead(uint8_t joypad, int frames);
+  // Emulated cycles so far, and how many of them were skipped in idle loops.
+  uint64_t cycles() const { return sched_.now(); }
+  uint64_t idleCycles() const { return idleCycles_; }
+  // Battery RAM. saveDirty() tells whether it changed since the last flush.
+  // takeSaveRanges() returns (offset, length) pairs of everything changed
+  // since then and marks it clean; the bytes are at saveRam() + offset.
+  bool saveDirty() { return mem_.cart().saveDirty(); }
+  uint8_t* saveRam() { return mem_.cart().saveRam(); }
+  size_t saveRamSize() { return mem_.cart().hasBattery() ? mem_.cart().saveRamSize() : 0; }
+  const std::vector<uint32_t>& takeSaveRanges();
+  // Snapshots of the whole machine in a fixed-layout, versioned binary
+  // format. saveState() returns the bytes written, or 0 when size is smaller
+  // than stateSize(). loadState() leaves the machine untouched and returns
+  // false when the blob has the wrong size or version or is for another ROM.
+  size_t stateSize();
+  size_t saveState(uint8_t* buf, size_t size);
+  bool loadState(const uint8_t* buf, size_t size);
+  // A new machine in the same state that runs on its own from here. It
+  // shares the ROM image, and VRAM and WRAM pages and cartridge RAM with
+  // this one until either writes them, so a fork costs little more than the
+  // pages it goes on to touch. It keeps the output and frame skip settings,
+  // and starts without rewind history, save file or background cache.
+  // Delete it like any other instance, before or after this one.
+  Gameboy* fork();
+  const std::vector<uint32_t>& saveRanges() const { return saveRanges_; }
+  // Keeps a state after every frame, up to frames of them in budget bytes;
+  // frames == 0 turns rewinding off. rewind() steps back up to frames
+  // frames and returns how many it stepped.
+  void setRewind(int frames, size_t budget);
+  int rewind(int frames);
+  // Keeps both background tile maps drawn in full, which makes lines of a
+  // scrolling background cheaper to render. Off by default; uses 130KB.
+  void setBackgroundCache(bool on) { video_.setBackgroundCache(on); }
+  // Leaves out the pixel work of up to maxSkip pictures after each drawn one
+  // when executeSingleFrame() takes longer than budgetMs on average, and
+  // goes back as it speeds up. budgetMs <= 0 skips maxSkip all the time.
+  // Emulation, timing and interrupts are the same whatever is skipped.
+  void setFrameSkip(int maxSkip, double budgetMs);
+  // Pictures currently left out after each drawn one.
+  int frameSkip() const { return skip_; }
+  // Headless mode for batch runs: renderCanvas is never called and, unless
+  // hash is set, no pixels are drawn. With hash, every nth picture is drawn
+  // and its hash kept in frameHash(). Emulation is the same in every mode.
+  // Leaving it puts back the frame skip settings it found.
+  void setHeadless(bool headless, bool hash, int every);
+  const uint64_t& frameHash() const { return video_.frameHash(); }
+  // Reads a byte the way the CPU would.
+  uint8_t peek(uint16_t addr) { return mem_.read(addr); }
+  const uint32_t* frame() const { return video_.frame(); }
+  // Writes the last finished picture to out as 160x144 shades, the R byte of
+  // each pixel of frame(), or zeros before there is one.
+  void pictureShades(uint8_t* out) const;
+  const uint32_t* frameBuffers() const { return video_.frameBuffers(); }
+  void setColors(const uint32_t colors[4]) { video_.setColors(colors); }
+#ifndef __EMSCRIPTEN__
+  void openSaveFile(const char* path) {
+    mem_.cart().openSaveFile(path);
+    mem_.remapCartRam();
+  }
+  // Writes only the changed parts of battery RAM to the save file.
+  void flushSave();
+#endif
 };
\ No newline at end of file
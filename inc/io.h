@@ -1,10 +1,12 @@
 #pragma once
 #include "memory.h"
+#include "timer.h"
 #include "video.h"
 
 #include <stdint.h>
 
 class Memory;
+class Timer;
 class Video;
 
 class IO {
@@ -12,12 +14,21 @@ class IO {
   uint8_t reg_[0x100];
   Memory* mem_;
   Video* video_;
+  Timer* timer_;
 
   uint8_t doDMA_(uint8_t arg);
 
  public:
   uint8_t oam[0xA0];
-  uint8_t vram[0x2000];
+  // VRAM in 256-byte copy-on-write pages, shared with forks until written.
+  // Memory maps them; a page is writable only while it is not shared.
+  uint8_t* vramPage[0x20];
+  // Set whenever DIV or TIMA is read, and bumped whenever the PPU, the timer
+  // or the joypad changes state. See CPU::checkIdleLoop_.
+  bool timerRead;
+  uint32_t events;
+  // Bumped whenever OAM may have changed: DMA, a CPU write or a state load.
+  uint32_t oamGen;
 
   enum REG {
     P1 = 0x00,
@@ -73,8 +84,10 @@ class IO {
     IRQ_JOYPAD,
   };
 
-  IO(Memory* mem, Video* video);
+  // parent is the machine being forked, whose VRAM is shared, if any.
+  IO(Memory* mem, Video* video, Timer* timer, const IO* parent = nullptr);
   ~IO();
+  uint8_t vram(uint16_t offset) const { return vramPage[offset >> 8][offset & 0xFF]; }
   uint8_t read(uint16_t addr);
   uint8_t write(uint16_t addr, uint8_t data);
   uint8_t& reg(REG name) {
@@ -85,4 +98,5 @@ class IO {
   void enableInterrupt();
   void requestInterrupt(IRQ irq);
   uint16_t acknowledgeInterrupt();
+  void serialize(Snapshot* state);
 };
\ No newline at end of file
@@ -69,4 +69,6 @@ struct JSStream {
   }
 };
 
-extern JSStream ERR;
+// One stream per thread, so machines can run on several at once. Each
+// machine points its thread's stream at itself while it runs a frame.
+extern thread_local JSStream ERR;
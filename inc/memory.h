@@ -11,16 +11,67 @@ class Memory {
   Cartridge cart_;
   IO* io_;
 
-  uint8_t* ram_;
+  // WRAM in 256-byte copy-on-write pages, like IO::vramPage.
+  uint8_t* ramPages_[0x20];
   uint8_t* highRam_;
+  // Bumped on every write to a WRAM/HRAM page, see codeTag().
+  uint32_t writeGen_[0x100];
+
+  // Host pointer to each 256-byte page, or nullptr when accesses to the page
+  // need a handler (IO registers, cartridge registers, OAM tail, HRAM).
+  const uint8_t* readPage_[0x100];
+  uint8_t* writePage_[0x100];
+
+  // Copy of VRAM, WRAM and cartridge RAM at the last checkpoint(), and the
+  // write generation each page had then.
+  uint8_t* shadow_;
+  uint32_t shadowGen_[0x100];
+
+  void mapPages_(uint16_t begin, uint16_t end, const uint8_t* read, uint8_t* write);
+  void mapCart_(uint8_t remap);
+  void mapRamPage_(int page);
+  uint8_t* ownPage_(int page);
+  uint8_t readSlow_(uint16_t addr);
+  uint8_t writeSlow_(uint16_t addr, uint8_t datum);
+  uint8_t* hostPage_(int page);
+  uint8_t* shadowPage_(int page);
 
  public:
-  Memory(Cartridge&& cart, IO* io);
+  // parent is the machine being forked, if any. Its WRAM is shared, and its
+  // VRAM already shared by IO, from then on.
+  Memory(Cartridge&& cart, IO* io, Memory* parent = nullptr);
   Memory(Memory&& oth);
   ~Memory();
-  uint8_t read(uint16_t addr);
+  uint8_t read(uint16_t addr) {
+    const uint8_t* page = readPage_[addr >> 8];
+    return page ? page[addr & 0xFF] : readSlow_(addr);
+  }
   uint16_t read16(uint16_t addr);
-  uint8_t write(uint16_t addr, uint8_t datum);
+  uint8_t write(uint16_t addr, uint8_t datum) {
+    uint8_t* page = writePage_[addr >> 8];
+    if (!page)
+      return writeSlow_(addr, datum);
+    ++writeGen_[addr >> 8];
+    return page[addr & 0xFF] = datum;
+  }
   uint16_t write16(uint16_t addr, uint16_t datum);
   IO& io() { return *io_; }
-};
\ No newline at end of file
+  // Copies out the 8KB at 0xC000-0xDFFF.
+  void copyWorkRam(uint8_t* out) const;
+  Cartridge& cart() { return cart_; }
+  // Write-protects cartridge RAM pages again after they were flushed.
+  void remapCartRam() { mapCart_(Cartridge::REMAP_RAM); }
+  // Maps VRAM and WRAM pages again after they were replaced or shared.
+  void remapRam();
+  void serialize(Snapshot* state);
+  // Remembers VRAM, WRAM and cartridge RAM, copying only the pages written
+  // since the previous checkpoint; restore() copies back only the pages
+  // written since this one.
+  void checkpoint();
+  void restore();
+  // Changes whenever the code at addr may have changed: the selected bank
+  // for ROM, a write generation for the 256-byte page in RAM.
+  const uint32_t& codeTag(uint16_t addr);
+  // Bumped on every write to the 256-byte RAM page at addr.
+  const uint32_t& writeGen(uint16_t addr) const { return writeGen_[addr >> 8]; }
+};
@@ -0,0 +1,154 @@
+#pragma once
+#include <stdint.h>
+
+#include <cstring>
+
+#if defined(__wasm_simd128__)
+#define PIXELS_SIMD "simd128"
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define PIXELS_SIMD "ssse3"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXELS_SIMD "sse2"
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PIXELS_SIMD "neon"
+#else
+#define PIXELS_SIMD "scalar"
+#endif
+
+// Scanline kernels of the PPU. The vector version is picked at build time
+// from the target: wasm simd128 (-msimd128), SSSE3, SSE2 or AArch64 NEON.
+// The scalar versions are the reference and are always available.
+//
+// The simd128 kernels are written with GCC/Clang vector extensions rather
+// than wasm_simd128.h, whose intrinsic names changed across emscripten
+// releases. They build the same natively, where tests check them.
+
+// Line pixels are palette indices: 0-3 background, 4-7 OBP0, 8-11 OBP1.
+// Lines the background was not drawn on still hold last frame's shades, of
+// which only the low nibble counts, as the old shift-by-index did on both
+// wasm and x86. lut holds the shade of each of the 16 nibble values.
+inline void shadeLineScalar(uint8_t* line, const uint8_t* lut) {
+  for (int i = 0; i < 160; ++i)
+    line[i] = lut[line[i] & 0x0F];
+}
+
+// Draws 8 sprite pixels of row over dst wherever dst is at most threshold.
+inline void mergeSpriteScalar(uint8_t* dst, const uint8_t* row, int n, uint8_t pal, uint8_t threshold) {
+  for (int j = 0; j < n; ++j) {
+    if (dst[j] <= threshold)
+      dst[j] = pal | row[j];
+  }
+}
+
+#if defined(__GNUC__)
+#define PIXELS_VECTOR 1
+typedef uint8_t PixelVector __attribute__((vector_size(16)));
+
+inline PixelVector pixelSelect(PixelVector mask, PixelVector a, PixelVector b) {
+  return (mask & a) | (~mask & b);
+}
+
+// As shadeLineScalar(), without a byte shuffle: each index bit picks
+// between halves of the table, from bit 0 up, as the SSE2 version does.
+inline void shadeLineVector(uint8_t* line, const uint8_t* lut) {
+  PixelVector e[16];
+  for (int k = 0; k < 16; ++k)
+    e[k] = PixelVector{} + lut[k];
+  for (int i = 0; i < 160; i += 16) {
+    PixelVector p;
+    memcpy(&p, line + i, sizeof(p));
+    PixelVector b0 = (PixelVector)((p & 1) != 0);
+    PixelVector b1 = (PixelVector)((p & 2) != 0);
+    PixelVector b2 = (PixelVector)((p & 4) != 0);
+    PixelVector b3 = (PixelVector)((p & 8) != 0);
+    PixelVector l0 = pixelSelect(b0, e[1], e[0]), l1 = pixelSelect(b0, e[3], e[2]);
+    PixelVector l2 = pixelSelect(b0, e[5], e[4]), l3 = pixelSelect(b0, e[7], e[6]);
+    PixelVector l4 = pixelSelect(b0, e[9], e[8]), l5 = pixelSelect(b0, e[11], e[10]);
+    PixelVector l6 = pixelSelect(b0, e[13], e[12]), l7 = pixelSelect(b0, e[15], e[14]);
+    PixelVector m0 = pixelSelect(b1, l1, l0), m1 = pixelSelect(b1, l3, l2);
+    PixelVector m2 = pixelSelect(b1, l5, l4), m3 = pixelSelect(b1, l7, l6);
+    PixelVector n0 = pixelSelect(b2, m1, m0), n1 = pixelSelect(b2, m3, m2);
+    p = pixelSelect(b3, n1, n0);
+    memcpy(line + i, &p, sizeof(p));
+  }
+}
+
+// As mergeSpriteScalar() for all 8 pixels.
+inline void mergeSpriteVector(uint8_t* dst, const uint8_t* row, uint8_t pal, uint8_t threshold) {
+  PixelVector d{}, s{};
+  memcpy(&d, dst, 8);
+  memcpy(&s, row, 8);
+  s |= PixelVector{} + pal;
+  PixelVector under = (PixelVector)(d <= PixelVector{} + threshold);
+  d = pixelSelect(under, s, d);
+  memcpy(dst, &d, 8);
+}
+#endif
+
+inline void shadeLine(uint8_t* line, const uint8_t* lut) {
+#if defined(__wasm_simd128__)
+  shadeLineVector(line, lut);
+#elif defined(__SSSE3__)
+  __m128i table = _mm_load_si128(reinterpret_cast<const __m128i*>(lut));
+  __m128i nibble = _mm_set1_epi8(0x0F);
+  for (int i = 0; i < 160; i += 16) {
+    __m128i p = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(line + i)), nibble);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(line + i), _mm_shuffle_epi8(table, p));
+  }
+#elif defined(__SSE2__)
+  // No byte shuffle before SSSE3. Each index bit instead picks between
+  // halves of the table, from bit 0 up: 8 + 4 + 2 + 1 selects per vector.
+  __m128i e[16];
+  for (int k = 0; k < 16; ++k)
+    e[k] = _mm_set1_epi8(lut[k]);
+  __m128i zero = _mm_setzero_si128();
+  auto select = [](__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+  };
+  for (int i = 0; i < 160; i += 16) {
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + i));
+    // Index bit b shifted into each byte's sign bit, as a byte mask.
+    __m128i b0 = _mm_cmplt_epi8(_mm_slli_epi16(p, 7), zero);
+    __m128i b1 = _mm_cmplt_epi8(_mm_slli_epi16(p, 6), zero);
+    __m128i b2 = _mm_cmplt_epi8(_mm_slli_epi16(p, 5), zero);
+    __m128i b3 = _mm_cmplt_epi8(_mm_slli_epi16(p, 4), zero);
+    __m128i l0 = select(b0, e[1], e[0]), l1 = select(b0, e[3], e[2]);
+    __m128i l2 = select(b0, e[5], e[4]), l3 = select(b0, e[7], e[6]);
+    __m128i l4 = select(b0, e[9], e[8]), l5 = select(b0, e[11], e[10]);
+    __m128i l6 = select(b0, e[13], e[12]), l7 = select(b0, e[15], e[14]);
+    __m128i m0 = select(b1, l1, l0), m1 = select(b1, l3, l2);
+    __m128i m2 = select(b1, l5, l4), m3 = select(b1, l7, l6);
+    __m128i n0 = select(b2, m1, m0), n1 = select(b2, m3, m2);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(line + i), select(b3, n1, n0));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  uint8x16_t table = vld1q_u8(lut);
+  uint8x16_t nibble = vdupq_n_u8(0x0F);
+  for (int i = 0; i < 160; i += 16)
+    vst1q_u8(line + i, vqtbl1q_u8(table, vandq_u8(vld1q_u8(line + i), nibble)));
+#else
+  shadeLineScalar(line, lut);
+#endif
+}
+
+// As mergeSpriteScalar() for all 8 pixels.
+inline void mergeSprite(uint8_t* dst, const uint8_t* row, uint8_t pal, uint8_t threshold) {
+#if defined(__wasm_simd128__)
+  mergeSpriteVector(dst, row, pal, threshold);
+#elif defined(__SSE2__) || defined(__SSSE3__)
+  __m128i d = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(dst));
+  __m128i s = _mm_or_si128(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row)), _mm_set1_epi8(pal));
+  __m128i under = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(threshold)), d);
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(dst),
+                   _mm_or_si128(_mm_and_si128(under, s), _mm_andnot_si128(under, d)));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  uint8x8_t d = vld1_u8(dst);
+  uint8x8_t s = vorr_u8(vld1_u8(row), vdup_n_u8(pal));
+  vst1_u8(dst, vbsl_u8(vcle_u8(d, vdup_n_u8(threshold)), s, d));
+#else
+  mergeSpriteScalar(dst, row, 8, pal, threshold);
+#endif
+}
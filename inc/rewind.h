@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// History of save states in a fixed memory budget. Only the newest state is
+// kept in full; each older one is stored as the XOR delta to its successor,
+// with the unchanged (zero) runs collapsed. The oldest deltas are dropped
+// when the budget or the frame limit is reached.
+class Rewind {
+ private:
+  struct Entry {
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  size_t stateSize_;
+  uint8_t* last_;   // newest state
+  uint8_t* next_;   // state being pushed
+  uint8_t* delta_;  // encoding scratch
+  bool hasLast_;
+
+  uint8_t* ring_;
+  size_t budget_;
+  size_t head_;  // where the next delta goes
+  Entry* entries_;
+  int maxEntries_;
+  int first_;  // oldest entry
+  int count_;
+
+  void drop_();
+
+ public:
+  Rewind(size_t stateSize, int frames, size_t budget);
+  ~Rewind();
+  // Buffer for the state to push, valid until push().
+  uint8_t* next() { return next_; }
+  void push();
+  // Steps back up to frames states and returns how many it stepped; the
+  // state reached is then at last().
+  int rewind(int frames);
+  const uint8_t* last() const { return last_; }
+  // Frames that can be rewound, and the bytes their deltas take.
+  int frames() const { return count_; }
+  size_t bytes() const;
+};
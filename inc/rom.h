@@ -0,0 +1,76 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// A ROM image and what its header says, shared by every cartridge running
+// the same game. Images are registered by content, and mapped files by
+// device, inode, size and modification time, so that any number of sessions
+// of one game, natively or in one wasm memory, hold a single copy with a
+// single bank table. Handles are counted; the image is released with the
+// last one.
+class Rom {
+ public:
+  // Who releases the image. OWNED images come from malloc (the JS side
+  // allocates them with the exported malloc), MAPPED ones from mmap(), and
+  // BORROWED ones outlive every handle and are left alone.
+  enum Ownership { OWNED, MAPPED, BORROWED };
+  enum MBC { MBC_NONE, MBC_1, MBC_3, MBC_5 };
+
+ private:
+  std::atomic<uint32_t> refs_;
+  const uint8_t* data_;
+  size_t size_;
+  Ownership ownership_;
+  uint64_t hash_;
+  // Device, inode and modification time of a file from mapFile(), or 0.
+  uint64_t file_[3];
+  MBC mbc_;
+  uint32_t romBanks_;
+  uint32_t ramBanks_;
+  bool battery_;
+  // Host memory of each bank register value, wrapped to the banks there are.
+  const uint8_t* banks_[0x200];
+
+  Rom(const uint8_t* data, size_t size, Ownership ownership);
+  ~Rom();
+
+ public:
+  // A handle on the registered image with the content of data, registering
+  // it if there is none. A copy registered already is used in its place and
+  // data is released at once, as ownership says. BORROWED images are only
+  // ever shared by the handles of that same buffer, since their owner may
+  // free them once it is done; when that owner acquires the buffer too, the
+  // registration becomes its, and the buffer is released with the last
+  // handle of either. size is the number of bytes at data. Throws
+  // on a bad header or an image shorter than it says, leaving data alone.
+  static Rom* acquire(const uint8_t* data, size_t size, Ownership ownership = OWNED);
+#ifndef __EMSCRIPTEN__
+  // Maps a ROM file read-only, unless the same file, unchanged, is mapped
+  // already. Files are never read to tell them apart, so that pages of the
+  // image are only faulted in as they run.
+  static Rom* mapFile(const char* path);
+#endif
+  // Images registered, for tests and statistics.
+  static size_t registered();
+  // Another handle on the same image.
+  Rom* share() {
+    refs_.fetch_add(1, std::memory_order_relaxed);
+    return this;
+  }
+  void release();
+
+  const uint8_t* data() const { return data_; }
+  // Bytes given, at least as many as the header promises.
+  size_t size() const { return size_; }
+  uint64_t hash() const { return hash_; }
+  MBC mbc() const { return mbc_; }
+  uint32_t romBanks() const { return romBanks_; }
+  uint32_t ramBanks() const { return ramBanks_; }
+  bool hasBattery() const { return battery_; }
+  // The 16KB bank selected by a bank register value.
+  const uint8_t* bank(uint32_t reg) const { return banks_[reg & 0x1FF]; }
+  // Header and global checksums, which tell ROMs apart.
+  uint32_t checksum() const { return data_[0x14D] << 16 | data_[0x14E] << 8 | data_[0x14F]; }
+};
@@ -0,0 +1,48 @@
+#pragma once
+#ifndef __EMSCRIPTEN__
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Runs many independent episodes on a pool of native threads. Each worker
+// takes episodes from its own queue and steals from the others' once that
+// is empty. Results depend only on the episode, not on the thread count or
+// which worker ran it. Each worker builds its machines in an arena of its
+// own, reset between episodes. An episode the core fails on is marked and
+// the rest carry on.
+class Runner {
+ public:
+  struct Episode {
+    // Borrowed ROM image, shared by any number of episodes; see
+    // Rom::acquire().
+    const uint8_t* rom;
+    size_t romSize;
+    int frames;
+    // One joypad byte per frame.
+    const uint8_t* inputs;
+    // Filled in: hash of the last picture and of the final save state, or
+    // failed, with both hashes 0, when the core threw on the way.
+    uint64_t frameHash;
+    uint64_t stateHash;
+    bool failed;
+  };
+
+ private:
+  int threads_;
+  uint64_t frames_;
+  double seconds_;
+
+ public:
+  // threads 0 uses every core.
+  explicit Runner(int threads = 0);
+  int threads() const { return threads_; }
+  // Throws, having run nothing, when a ROM is rejected.
+  void run(std::vector<Episode>* episodes);
+  // Emulated frames of the episodes that did not fail, and wall time, of
+  // the last run().
+  uint64_t frames() const { return frames_; }
+  double seconds() const { return seconds_; }
+  double framesPerSecond() const { return seconds_ > 0 ? frames_ / seconds_ : 0; }
+};
+#endif
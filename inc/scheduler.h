@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+
+#include "snapshot.h"
+
+// Keeps the global cycle timestamp and the deadline of every pending event.
+// There are only a handful of events, so the queue is a plain array with a
+// cached minimum.
+class Scheduler {
+ public:
+  enum Event {
+    EVENT_VIDEO = 0,
+    EVENT_TIMER,
+    EVENT_FRAME,
+    EVENT_COUNT,
+  };
+  static const uint64_t NEVER = UINT64_MAX;
+
+ private:
+  uint64_t now_;
+  uint64_t next_;
+  uint64_t deadline_[EVENT_COUNT];
+
+  void update_();
+
+ public:
+  Scheduler();
+  uint64_t now() const { return now_; }
+  // Deadline of the earliest pending event.
+  uint64_t next() const { return next_; }
+  void advance(int cycles) { now_ += cycles; }
+  void schedule(Event event, uint64_t at);
+  void cancel(Event event) { schedule(event, NEVER); }
+  // Takes the earliest event that is due at now(). Handlers reschedule
+  // themselves if they recur.
+  bool pop(Event* event, uint64_t* at);
+  void serialize(Snapshot* state);
+};
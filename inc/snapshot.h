@@ -0,0 +1,62 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstring>
+
+// Cursor over a caller-provided save state buffer. Every component has a
+// single serialize() that both saves and loads, so the two always agree on
+// the field order. The layout depends only on the cartridge, and
+// STATE_VERSION is bumped whenever it changes.
+class Snapshot {
+ private:
+  uint8_t* buf_;
+  size_t size_;
+  size_t pos_;
+  bool loading_;
+  bool bulk_;
+  bool ok_;
+
+ public:
+  // Counts the size of a state without writing anything.
+  Snapshot() : buf_(nullptr), size_(SIZE_MAX), pos_(0), loading_(false), bulk_(true), ok_(true) {}
+  Snapshot(uint8_t* buf, size_t size)
+      : buf_(buf), size_(size), pos_(0), loading_(false), bulk_(true), ok_(true) {}
+  Snapshot(const uint8_t* buf, size_t size)
+      : buf_(const_cast<uint8_t*>(buf)), size_(size), pos_(0), loading_(true), bulk_(true), ok_(true) {}
+
+  // Leaves out VRAM, WRAM, cartridge RAM and the frame buffer, which the
+  // caller restores page by page (see Gameboy::runAhead).
+  void skipBulk() { bulk_ = false; }
+  bool bulk() const { return bulk_; }
+  bool loading() const { return loading_; }
+  bool ok() const { return ok_; }
+  size_t size() const { return pos_; }
+
+  // Returns the next n bytes of the buffer and skips them, or nullptr when
+  // counting or out of room.
+  uint8_t* take(size_t n) {
+    if (n > size_ - pos_) {
+      ok_ = false;
+      return nullptr;
+    }
+    uint8_t* p = buf_ ? buf_ + pos_ : nullptr;
+    pos_ += n;
+    return p;
+  }
+  void bytes(void* data, size_t n) {
+    uint8_t* p = take(n);
+    // Also when n is 0: data may then be null, as for a cartridge without
+    // RAM, and memcpy must not see it.
+    if (p == nullptr || n == 0)
+      return;
+    if (loading_)
+      memcpy(data, p, n);
+    else
+      memcpy(p, data, n);
+  }
+  template <typename T>
+  void field(T& value) {
+    bytes(&value, sizeof(value));
+  }
+};
@@ -1,17 +1,29 @@
 #pragma once
 #include "io.h"
+#include "scheduler.h"
 
 #include <stdint.h>
 
 class IO;
 
+// DIV and TIMA are derived from the scheduler timestamp on demand; only the
+// TIMA overflow, which raises an interrupt, is a scheduled event.
 class Timer {
  private:
   IO* io_;
-  int divTiming_;
-  int timing_;
+  Scheduler* sched_;
+  uint64_t divBase_;  // DIV ticks at the last DIV write
+  uint64_t next_;     // timestamp of the next TIMA tick
+  bool running_;
+
  public:
-  Timer(IO* io);
+  Timer(IO* io, Scheduler* sched);
   ~Timer() {}
-  void runCycles(int cycles);
-};
\ No newline at end of file
+  // Brings DIV and TIMA up to the current timestamp.
+  void sync();
+  // Reschedules the overflow after a TIMA or TAC write.
+  void reschedule();
+  void resetDiv();
+  void onEvent();
+  void serialize(Snapshot* state);
+};
@@ -1,25 +1,118 @@
 #pragma once
 #include "io.h"
+#include "scheduler.h"
 
 #include <stdint.h>
 
 class IO;
+class Memory;
 
 class Video {
+ public:
+  // Where finished pictures go, as bits: the canvas, a hash of them, frame()
+  // without showing them, or nowhere, in which case no pixel work is done.
+  enum Output { OUTPUT_NONE = 0, OUTPUT_CANVAS = 1, OUTPUT_HASH = 2, OUTPUT_FRAME = 4 };
+
  private:
   IO* io_;
+  Memory* mem_;
+  Scheduler* sched_;
   int canvasId_;
-  int timing_;
-  uint8_t buf_[144 * 160];
+  // Picture being drawn, a shade per pixel. Copy-on-write, so that forks
+  // that draw nothing never copy it.
+  uint8_t* buf_;
+
+  // Tile data decoded to one 2-bit color per byte, 8x8 per tile, plus a
+  // mirrored copy for flipped sprites. Decoded 16 tiles (one 256-byte VRAM
+  // page) at a time whenever the page's write generation has moved on.
+  static const int TILES = 384;
+  uint8_t tiles_[TILES * 64];
+  uint8_t flippedTiles_[TILES * 64];
+  uint32_t tileGen_[TILES / 16];
+
+  const uint8_t* tile_(int tid, bool flipped);
+
+  // Optional background layer: each tile map kept drawn as a 256x256 bitmap
+  // so that a line is a wrapped copy. Cells are redrawn, a tile row at a time
+  // when first needed, once their map entry or tile data has changed.
+  struct BackgroundMap {
+    uint8_t pixels[256 * 256];
+    // Tile drawn in each cell, and per tile row the cells to redraw.
+    uint16_t tile[32 * 32];
+    uint32_t dirty[32];
+    bool unsignedData;
+    uint32_t mapGen[4];
+    uint32_t tileGen[TILES / 16];
+  };
+  BackgroundMap* bgMaps_;
+
+  void syncBackgroundMap_(int map, bool unsignedData);
+
+  // Sprites drawn on each line, at most 10, in drawing order. Rebuilt from
+  // OAM only when it or the sprite height has changed.
+  uint8_t lineSprites_[144][10];
+  uint8_t lineSpriteCount_[144];
+  uint32_t spriteGen_;
+  int spriteSize_;
+
+  void bucketSprites_(int spSize);
+  // Run-ahead support: whether lines are rendered and finished frames shown,
+  // and the frame buffer at the last checkpoint with the lines drawn since.
+  bool render_;
+  bool present_;
+  uint8_t* shadow_;
+  bool lineDirty_[144];
+  // Frame skip: pictures left out after each drawn one, how many of them are
+  // still to come, and whether the current one is left out. Timing and
+  // interrupts are the same either way.
+  int skip_;
+  int skipLeft_;
+  bool skipping_;
+  uint8_t output_;
+  uint64_t frameHash_;
+
+  // Finished frames as 32-bit pixels, one being shown while the other is
+  // written, and the pixel of each shade in buf_. Forks allocate them with
+  // their first picture, unless they start with the parent's; so do
+  // machines that go headless before their first, see setOutputTarget().
+  uint32_t (*frames_)[144 * 160];
+  bool framesUsed_;
+  int front_;
+  uint32_t pixel_[256];
 
   void renderBackgroundLine_(uint8_t LCDC, uint8_t LY);
   void renderSpriteLine_(uint8_t LCDC, uint8_t LY);
   void renderLine_(uint8_t LCDC, uint8_t LY);
   void drawFrame_(uint8_t LY);
  public:
-  Video(IO* io, int canvasId);
-  void runCycles(int cycles);
-  void resetTimer() {
-    timing_ = 0;
-  }
+  // A fork of parent, if given, starts with its picture, canvas and output
+  // settings and without its caches.
+  Video(IO* io, Memory* mem, Scheduler* sched, int canvasId, const Video* parent = nullptr);
+  ~Video();
+  // Runs the mode change that was due at the given timestamp.
+  void onEvent(uint64_t at);
+  // Restarts the mode timing after LY is reset or the LCD is switched.
+  void resetTimer();
+  void serialize(Snapshot* state);
+  void setOutput(bool render, bool present);
+  // Draws only one picture in every skip + 1, starting with the next one.
+  void setFrameSkip(int skip);
+  void setOutputTarget(uint8_t output);
+  uint8_t outputTarget() const { return output_; }
+  // Hash of the last finished picture under OUTPUT_HASH.
+  const uint64_t& frameHash() const { return frameHash_; }
+  // Last finished frame, 160x144 pixels of 4 bytes. Stays put until the
+  // next one is finished. nullptr in a fork of a machine that output no
+  // frames, until the fork finishes one.
+  const uint32_t* frame() const { return frames_ ? frames_[front_] : nullptr; }
+  // Both frame buffers, back to back, or nullptr if none were allocated.
+  const uint32_t* frameBuffers() const { return frames_ ? frames_[0] : nullptr; }
+  // Sets the 4 bytes written for each of the four shades, lightest first,
+  // in memory order. The default is opaque gray, R = G = B = shade, A = 255.
+  void setColors(const uint32_t colors[4]);
+  // Switches the pre-rendered background maps on or off.
+  void setBackgroundCache(bool on);
+  // Remembers the frame buffer, or puts back the lines drawn since.
+  void checkpoint();
+  void restore();
 };
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include "arena.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// Precedes every block: the arena it came from, nullptr for the heap, and
+// its size with the header. Keeps the block 16-byte aligned.
+struct alignas(16) BlockHeader {
+  Arena* arena;
+  size_t size;
+};
+
+thread_local Arena* current = nullptr;
+
+size_t roundUp(size_t size, size_t to) {
+  return (size + to - 1) / to * to;
+}
+
+}  // namespace
+
+Arena::Arena(size_t size) : base_(nullptr), size_(0), used_(0) {
+  // On a cache line of its own, so that workers' arenas share none.
+  size = roundUp(size, 64);
+  base_ = static_cast<uint8_t*>(aligned_alloc(64, size));
+  if (base_ != nullptr)
+    size_ = size;
+}
+
+Arena::~Arena() {
+  free(base_);
+}
+
+void* Arena::alloc(size_t size) {
+  if (size > size_ - used_)
+    return nullptr;
+  void* p = base_ + used_;
+  used_ += size;
+  return p;
+}
+
+void Arena::release(void* p, size_t size) {
+  if (static_cast<uint8_t*>(p) + size == base_ + used_)
+    used_ -= size;
+}
+
+ArenaScope::ArenaScope(Arena* arena) : previous_(current) {
+  current = arena;
+}
+
+ArenaScope::~ArenaScope() {
+  current = previous_;
+}
+
+void* arenaAlloc(size_t size) {
+  size_t total = roundUp(sizeof(BlockHeader) + size, sizeof(BlockHeader));
+  Arena* arena = current;
+  void* block = arena != nullptr ? arena->alloc(total) : nullptr;
+  if (block == nullptr) {
+    arena = nullptr;
+    block = aligned_alloc(sizeof(BlockHeader), total);
+    if (block == nullptr)
+      throw std::bad_alloc();
+  }
+  BlockHeader* header = new (block) BlockHeader{arena, total};
+  return header + 1;
+}
+
+void arenaFree(void* p) {
+  if (p == nullptr)
+    return;
+  BlockHeader* header = static_cast<BlockHeader*>(p) - 1;
+  // Another thread's arena is left alone; its reset() reclaims the block.
+  if (header->arena == nullptr)
+    free(header);
+  else if (header->arena == current)
+    header->arena->release(header, header->size);
+}
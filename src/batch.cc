@@ -0,0 +1,92 @@
+#include "batch.h"
+
+#include "cartridge.h"
+#include "log.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Machines are placed a whole number of cache lines apart so that no two
+// share a line.
+const size_t CACHE_LINE = 64;
+
+GameboyBatch::GameboyBatch(uint8_t* romData, size_t size, int count)
+    : count_(0), obsFlags_(0), doneAddr_(0), doneMask_(0), doneValue_(0) {
+  if (count <= 0) {
+    free(romData);
+    ERR << "Batch needs at least one machine: " << count << endl;
+    throw 1;
+  }
+  try {
+    rom_ = Rom::acquire(romData, size, Rom::OWNED);
+  } catch (...) {
+    free(romData);
+    throw;
+  }
+  stride_ = (sizeof(Gameboy) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  machines_ = static_cast<uint8_t*>(aligned_alloc(CACHE_LINE, stride_ * count));
+  if (machines_ == nullptr) {
+    rom_->release();
+    ERR << "Cannot allocate " << count << " machines" << endl;
+    throw 1;
+  }
+  // Every cartridge holds a handle on the batch's image.
+  try {
+    for (; count_ < count; ++count_)
+      new (machines_ + count_ * stride_) Gameboy(Cartridge(rom_->share()), 0);
+  } catch (...) {
+    for (int i = 0; i < count_; ++i)
+      (*this)[i].~Gameboy();
+    free(machines_);
+    rom_->release();
+    throw;
+  }
+  for (int i = 0; i < count_; ++i)
+    (*this)[i].setHeadless(true, false, 1);
+  start_.resize((*this)[0].stateSize());
+  (*this)[0].saveState(start_.data(), start_.size());
+}
+
+GameboyBatch::~GameboyBatch() {
+  for (int i = 0; i < count_; ++i)
+    (*this)[i].~Gameboy();
+  free(machines_);
+  rom_->release();
+}
+
+void GameboyBatch::setObservation(const uint16_t* addrs, int n, uint32_t flags) {
+  ramAddrs_.assign(addrs, addrs + n);
+  obsFlags_ = flags;
+}
+
+size_t GameboyBatch::observationSize() const {
+  return 1 + ramAddrs_.size() + ((obsFlags_ & OBS_PICTURE) ? 144 * 160 : 0);
+}
+
+void GameboyBatch::setDone(uint16_t addr, uint8_t mask, uint8_t value) {
+  doneAddr_ = addr;
+  doneMask_ = mask;
+  doneValue_ = value;
+}
+
+void GameboyBatch::step(const uint8_t* actions, int frames, uint8_t* out) {
+  uint32_t flags = Gameboy::EXEC_HOLD_INPUT;
+  if (obsFlags_ & OBS_PICTURE)
+    flags |= Gameboy::EXEC_KEEP_LAST;
+  size_t size = observationSize();
+  for (int i = 0; i < count_; ++i) {
+    Gameboy& gb = (*this)[i];
+    gb.executeFrames(frames, actions + i, flags, nullptr, 0);
+    uint8_t* obs = out + i * size;
+    *obs++ = doneMask_ != 0 && (gb.peek(doneAddr_) & doneMask_) == doneValue_;
+    for (uint16_t addr : ramAddrs_)
+      *obs++ = gb.peek(addr);
+    if (obsFlags_ & OBS_PICTURE)
+      gb.pictureShades(obs);
+  }
+}
+
+void GameboyBatch::reset(int i) {
+  (*this)[i].loadState(start_.data(), start_.size());
+}
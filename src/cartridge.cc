@@ -1,37 +1,317 @@
 #include "cartridge.h"
 
+#include "cow.h"
 #include "log.h"
 
-Cartridge::Cartridge(uint8_t* data) {
-  data_ = data;
+#include <cstring>
+
+#ifndef __EMSCRIPTEN__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+const uint32_t RAM_BANK_SIZE = 0x2000;
+
+Cartridge::Cartridge(Rom* rom) {
+  rom_ = rom;
+  data_ = rom_->data();
+  mbc_ = rom_->mbc();
+  romBanks_ = rom_->romBanks();
+  ramBanks_ = rom_->ramBanks();
+  battery_ = rom_->hasBattery();
   ram_ = nullptr;
+  ramBank_ = nullptr;
+  romBankData_ = nullptr;
+  romBank_ = 0;
+  if (ramBanks_ != 0)
+    ram_ = cowAlloc(ramBanks_ * RAM_BANK_SIZE);
+  // Cartridges without a controller have their RAM always mapped.
+  ramEnabled_ = mbc_ == Rom::MBC_NONE && ram_ != nullptr;
+  romBankReg_ = 1;
+  ramBankReg_ = 0;
+  mode_ = 0;
+  memset(rtc_, 0, sizeof(rtc_));
+  ramChanged_ = false;
+  memset(ramDirty_, 0, sizeof(ramDirty_));
+  saveFd_ = -1;
+  remapRom_();
+  remapRam_();
 }
 
+Cartridge::Cartridge(const uint8_t* data, size_t size, Ownership ownership)
+    : Cartridge(Rom::acquire(data, size, ownership)) {}
+
 Cartridge::Cartridge(Cartridge&& oth) {
+  rom_ = oth.rom_;
+  oth.rom_ = nullptr;
   data_ = oth.data_;
-  oth.data_ = nullptr;
   ram_ = oth.ram_;
   oth.ram_ = nullptr;
   ramBank_ = oth.ramBank_;
   oth.ramBank_ = nullptr;
+  romBankData_ = oth.romBankData_;
+  romBank_ = oth.romBank_;
+  mbc_ = oth.mbc_;
+  romBanks_ = oth.romBanks_;
+  ramBanks_ = oth.ramBanks_;
+  ramEnabled_ = oth.ramEnabled_;
+  romBankReg_ = oth.romBankReg_;
+  ramBankReg_ = oth.ramBankReg_;
+  mode_ = oth.mode_;
+  memcpy(rtc_, oth.rtc_, sizeof(rtc_));
+  battery_ = oth.battery_;
+  ramChanged_ = oth.ramChanged_;
+  memcpy(ramDirty_, oth.ramDirty_, sizeof(ramDirty_));
+  saveFd_ = oth.saveFd_;
+  oth.saveFd_ = -1;
+}
+
+Cartridge::Cartridge(const Cartridge& oth) {
+  rom_ = oth.rom_->share();
+  data_ = oth.data_;
+  ram_ = oth.ram_ != nullptr ? cowShare(oth.ram_) : nullptr;
+  ramBank_ = oth.ramBank_;
+  romBankData_ = oth.romBankData_;
+  romBank_ = oth.romBank_;
+  mbc_ = oth.mbc_;
+  romBanks_ = oth.romBanks_;
+  ramBanks_ = oth.ramBanks_;
+  ramEnabled_ = oth.ramEnabled_;
+  romBankReg_ = oth.romBankReg_;
+  ramBankReg_ = oth.ramBankReg_;
+  mode_ = oth.mode_;
+  memcpy(rtc_, oth.rtc_, sizeof(rtc_));
+  battery_ = oth.battery_;
+  ramChanged_ = false;
+  memset(ramDirty_, 0, sizeof(ramDirty_));
+  saveFd_ = -1;
+}
+
+Cartridge Cartridge::fork() const {
+  return Cartridge(*this);
 }
 
 Cartridge::~Cartridge() {
-  delete data_;
-  delete ram_;
+  if (rom_ != nullptr)
+    rom_->release();
+  cowRelease(ram_);
+#ifndef __EMSCRIPTEN__
+  if (saveFd_ >= 0)
+    close(saveFd_);
+#endif
+}
+
+#ifndef __EMSCRIPTEN__
+Cartridge Cartridge::mapFile(const char* path) {
+  return Cartridge(Rom::mapFile(path));
 }
+#endif
 
-uint8_t Cartridge::rom(uint16_t addr) {
-  return data_[addr];
+uint8_t Cartridge::remapRom_() {
+  uint32_t bank = romBankReg_;
+  if (mbc_ == Rom::MBC_1)
+    bank |= ramBankReg_ << 5;
+  const uint8_t* data = rom_->bank(bank);
+  if (romBankData_ == data)
+    return REMAP_NONE;
+  romBank_ = bank & (romBanks_ - 1);
+  romBankData_ = data;
+  return REMAP_ROM;
 }
 
-uint8_t& Cartridge::ram(uint16_t addr) {
-  ERR << "Cart RAM! " << addr << endl;
-  throw 1;
-  return ramBank_[addr];
+uint8_t Cartridge::remapRam_() {
+  uint8_t* bank = nullptr;
+  if (ramBanks_ != 0) {
+    uint32_t index = ramBankReg_;
+    if (mbc_ == Rom::MBC_1 && mode_ == 0)
+      index = 0;
+    // MBC3 clock registers are served by readRam/writeRam.
+    if (!(mbc_ == Rom::MBC_3 && index >= 0x08))
+      bank = ram_ + (index & (ramBanks_ - 1)) * RAM_BANK_SIZE;
+  }
+  if (bank == ramBank_)
+    return REMAP_NONE;
+  ramBank_ = bank;
+  return REMAP_RAM;
+}
+
+uint8_t Cartridge::readRam(uint16_t addr) {
+  if (ramEnabled_ && mbc_ == Rom::MBC_3 && ramBankReg_ >= 0x08 && ramBankReg_ <= 0x0C)
+    return rtc_[ramBankReg_ - 0x08];
+  // Reached only when no RAM is mapped.
+  return 0xFF;
+}
+
+void Cartridge::writeRam(uint16_t addr, uint8_t datum) {
+  if (ramEnabled_ && ramBank_ != nullptr) {
+    ownRam();
+    uint32_t page = (ramBank_ - ram_ + addr) >> 8;
+    ramDirty_[page >> 6] |= uint64_t(1) << (page & 63);
+    ramChanged_ = true;
+    ramBank_[addr] = datum;
+    return;
+  }
+  if (ramEnabled_ && mbc_ == Rom::MBC_3 && ramBankReg_ >= 0x08 && ramBankReg_ <= 0x0C)
+    rtc_[ramBankReg_ - 0x08] = datum;
+}
+
+bool Cartridge::ramPageWritable(uint16_t addr) const {
+  if (cowShared(ram_))
+    return false;
+  if (!battery_)
+    return true;
+  uint32_t page = (ramBank_ - ram_ + addr) >> 8;
+  return ramDirty_[page >> 6] >> (page & 63) & 1;
+}
+
+void Cartridge::ownRam() {
+  if (ram_ == nullptr)
+    return;
+  ptrdiff_t bank = ramBank_ != nullptr ? ramBank_ - ram_ : -1;
+  ram_ = cowOwn(ram_);
+  if (bank >= 0)
+    ramBank_ = ram_ + bank;
+}
+
+void Cartridge::takeDirtyRanges(std::vector<uint32_t>* ranges) {
+  auto dirty = [this](uint32_t page) { return ramDirty_[page >> 6] >> (page & 63) & 1; };
+  uint32_t pages = saveRamSize() >> 8;
+  for (uint32_t page = 0; page < pages; ++page) {
+    if (!dirty(page))
+      continue;
+    uint32_t begin = page;
+    while (page + 1 < pages && dirty(page + 1))
+      ++page;
+    ranges->push_back(begin << 8);
+    ranges->push_back((page + 1 - begin) << 8);
+  }
+  memset(ramDirty_, 0, sizeof(ramDirty_));
+  ramChanged_ = false;
+}
+
+#ifndef __EMSCRIPTEN__
+void Cartridge::openSaveFile(const char* path) {
+  if (!battery_)
+    return;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    ERR << "Cannot open save file: " << path << endl;
+    throw 1;
+  }
+  ownRam();
+  // A missing or short file leaves the rest of the RAM zeroed.
+  if (pread(fd, ram_, saveRamSize(), 0) < 0) {
+    close(fd);
+    ERR << "Cannot read save file: " << path << endl;
+    throw 1;
+  }
+  if (saveFd_ >= 0)
+    close(saveFd_);
+  saveFd_ = fd;
+}
+
+void Cartridge::writeSave(const std::vector<uint32_t>& ranges) {
+  if (saveFd_ < 0)
+    return;
+  for (size_t i = 0; i < ranges.size(); i += 2) {
+    if (pwrite(saveFd_, ram_ + ranges[i], ranges[i + 1], ranges[i]) != static_cast<ssize_t>(ranges[i + 1])) {
+      ERR << "Cannot write save file" << endl;
+      throw 1;
+    }
+  }
+}
+#endif
+
+void Cartridge::serialize(Snapshot* state) {
+  state->field(romBankReg_);
+  state->field(ramBankReg_);
+  state->field(mode_);
+  state->field(ramEnabled_);
+  state->field(rtc_);
+  if (!state->bulk()) {
+    if (state->loading()) {
+      remapRom_();
+      remapRam_();
+    }
+  } else if (!state->loading()) {
+    state->bytes(ram_, saveRamSize());
+  } else {
+    const uint8_t* src = state->take(saveRamSize());
+    for (uint32_t page = 0; src && page < saveRamSize() >> 8; ++page) {
+      if (battery_ && memcmp(ram_ + (page << 8), src + (page << 8), 0x100) != 0) {
+        ramDirty_[page >> 6] |= uint64_t(1) << (page & 63);
+        ramChanged_ = true;
+      }
+    }
+    if (src && ram_ != nullptr) {
+      ownRam();
+      memcpy(ram_, src, saveRamSize());
+    }
+    remapRom_();
+    remapRam_();
+  }
 }
 
 uint8_t Cartridge::write(uint16_t addr, uint8_t datum) {
-  ERR << "Cart Write " << addr << " " << datum << endl;
-  return 0;
-}
\ No newline at end of file
+  switch (mbc_) {
+    case Rom::MBC_NONE:
+      return REMAP_NONE;
+    case Rom::MBC_1:
+      switch (addr >> 13) {
+        case 0:
+          break;
+        case 1:
+          romBankReg_ = (datum & 0x1F) ? datum & 0x1F : 1;
+          return remapRom_();
+        case 2:
+          ramBankReg_ = datum & 0x03;
+          return remapRom_() | remapRam_();
+        case 3:
+          // Mode 1 would also bank 0x0000-0x3FFF on large carts; that window
+          // stays at bank 0 here.
+          mode_ = datum & 0x01;
+          return remapRam_();
+      }
+      break;
+    case Rom::MBC_3:
+      switch (addr >> 13) {
+        case 0:
+          break;
+        case 1:
+          romBankReg_ = (datum & 0x7F) ? datum & 0x7F : 1;
+          return remapRom_();
+        case 2:
+          ramBankReg_ = datum & 0x0F;
+          return remapRam_();
+        case 3:
+          // Clock latch: the clock does not run, nothing to latch.
+          return REMAP_NONE;
+      }
+      break;
+    case Rom::MBC_5:
+      switch (addr >> 12) {
+        case 0:
+        case 1:
+          break;
+        case 2:
+          romBankReg_ = (romBankReg_ & 0x100) | datum;
+          return remapRom_();
+        case 3:
+          romBankReg_ = (romBankReg_ & 0xFF) | (datum & 0x01) << 8;
+          return remapRom_();
+        case 4:
+        case 5:
+          ramBankReg_ = datum & 0x0F;
+          return remapRam_();
+        default:
+          return REMAP_NONE;
+      }
+      break;
+  }
+  // 0x0000-0x1FFF: RAM enable.
+  bool enabled = (datum & 0x0F) == 0x0A;
+  if (enabled == ramEnabled_)
+    return REMAP_NONE;
+  ramEnabled_ = enabled;
+  return REMAP_RAM;
+}
@@ -1,6 +1,11 @@
 #include "cpu.h"
+#include "arena.h"
 #include "log.h"
 
+#include <array>
+#include <cstring>
+#include <utility>
+
 CPU::CPU(Memory* mem) : mem_(mem) {
   reg_.af = 0x01;
   reg_.f = 0xB0;
@@ -9,6 +14,21 @@ CPU::CPU(Memory* mem) : mem_(mem) {
   reg_.hl = 0x014D;
   reg_.sp = 0xFFFE;
   reg_.pc = 0x100;
+  lazyFlags_ = {FLAGS_NONE, 0, 0, 0, 0};
+  state_ = RUNNING;
+
+  // Allocated on first use, so that forks which never run cost nothing.
+  blocks_ = nullptr;
+  block_ = nullptr;
+  blockIdx_ = 0;
+  passCycles_ = 0;
+  passEvents_ = 0;
+  idleLoop_ = 0;
+  memset(&idleRegs_, 0, sizeof(idleRegs_));
+}
+
+CPU::~CPU() {
+  arenaFree(blocks_);
 }
 
 #define FLAG(Z, N, H, C) ((Z) << 7 | (N) << 6 | (H) << 5 | (C) << 4)
@@ -18,1498 +38,940 @@ CPU::CPU(Memory* mem) : mem_(mem) {
 #define FLAG_C(f) (((f) >> 4) & 1)
 #define N_BIT(x, n) (((x) >> (n)) & 1)
 
-void add(uint8_t* x, uint8_t* y, uint8_t* f) {
-  uint8_t r8 = (*x & 0xF) + (*y & 0xF);
-  uint16_t r16 = (uint16_t)*x + (uint16_t)*y;
-  *x += *y;
-  *f = FLAG(*x == 0, 0, r8 >> 4 != 0, r16 >> 8 != 0);
+uint8_t CPU::flags() {
+  const LazyFlags& l = lazyFlags_;
+  switch (l.op) {
+    case FLAGS_NONE:
+      return reg_.f;
+    case FLAGS_ADD:
+      reg_.f = FLAG(l.r == 0, 0, (l.x & 0xF) + (l.y & 0xF) > 0xF, l.r < l.x);
+      break;
+    case FLAGS_SUB:
+      reg_.f = FLAG(l.x == l.y, 1, (l.x & 0xF) < (l.y & 0xF), l.x < l.y);
+      break;
+    case FLAGS_AND:
+      reg_.f = FLAG(l.r == 0, 0, 1, 0);
+      break;
+    case FLAGS_LOGIC:
+      reg_.f = FLAG(l.r == 0, 0, 0, 0);
+      break;
+    case FLAGS_INC:
+      reg_.f = FLAG(l.r == 0, 0, (l.r & 0xF) == 0, l.c);
+      break;
+    case FLAGS_DEC:
+      reg_.f = FLAG(l.r == 0, 1, (l.r & 0xF) == 0xF, l.c);
+      break;
+    case FLAGS_SHIFT:
+      reg_.f = FLAG(l.r == 0, 0, 0, l.c);
+      break;
+    case FLAGS_BIT:
+      reg_.f = FLAG(l.r == 0, 0, 1, l.c);
+      break;
+  }
+  lazyFlags_.op = FLAGS_NONE;
+  return reg_.f;
+}
+
+uint8_t CPU::carry() {
+  const LazyFlags& l = lazyFlags_;
+  switch (l.op) {
+    case FLAGS_NONE:
+      return FLAG_C(reg_.f);
+    case FLAGS_ADD:
+      return l.r < l.x;
+    case FLAGS_SUB:
+      return l.x < l.y;
+    case FLAGS_AND:
+    case FLAGS_LOGIC:
+      return 0;
+    default:
+      return l.c;
+  }
+}
+
+void CPU::setFlags(uint8_t f) {
+  reg_.f = f;
+  lazyFlags_.op = FLAGS_NONE;
 }
 
-void adc(uint8_t* x, uint8_t y, uint8_t* f) {
-  uint8_t r8 = (*x & 0xF) + (y & 0xF) + FLAG_C(*f);
-  uint16_t r16 = (uint16_t)*x + (uint16_t)y;
-  *x += y + FLAG_C(*f);
-  *f = FLAG(*x == 0, 0, r8 >> 4 != 0, r16 >> 8 != 0);
+void CPU::setLazyFlags(uint8_t op, uint8_t x, uint8_t y, uint8_t r, uint8_t c) {
+  lazyFlags_.op = op;
+  lazyFlags_.x = x;
+  lazyFlags_.y = y;
+  lazyFlags_.r = r;
+  lazyFlags_.c = c;
 }
 
-void sub(uint8_t* x, uint8_t y, uint8_t* f) {
-  *f = FLAG(*x == y, 1, (*x & 0xF) < (y & 0xF), *x < y);
+void add(uint8_t* x, uint8_t y, CPU* cpu) {
+  uint8_t old = *x;
+  *x += y;
+  cpu->setLazyFlags(CPU::FLAGS_ADD, old, y, *x, 0);
+}
+
+void adc(uint8_t* x, uint8_t y, CPU* cpu) {
+  uint8_t c = cpu->carry();
+  uint8_t r8 = (*x & 0xF) + (y & 0xF) + c;
+  uint16_t r16 = (uint16_t)*x + (uint16_t)y + c;
+  *x += y + c;
+  cpu->setFlags(FLAG(*x == 0, 0, r8 >> 4 != 0, r16 >> 8 != 0));
+}
+
+void sub(uint8_t* x, uint8_t y, CPU* cpu) {
+  cpu->setLazyFlags(CPU::FLAGS_SUB, *x, y, 0, 0);
   *x -= y;
 }
 
-void sbc(uint8_t* x, uint8_t y, uint8_t* f) {
-  *f = FLAG(*x == y, 1, (*x & 0xF) < (y & 0xF) + FLAG_C(*f), *x < y + FLAG_C(*f));
-  *x -= y + FLAG_C(*f);
+void sbc(uint8_t* x, uint8_t y, CPU* cpu) {
+  uint8_t c = cpu->carry();
+  int r = *x - y - c;
+  cpu->setFlags(FLAG((r & 0xFF) == 0, 1, (*x & 0xF) < (y & 0xF) + c, r < 0));
+  *x = r;
 }
 
-void add(uint16_t* x, uint16_t y, uint8_t* f) {
+void add(uint16_t* x, uint16_t y, CPU* cpu) {
   uint16_t r16 = (*x & 0xFFF) + (y & 0xFFF);
   uint32_t r32 = (uint32_t)*x + (uint32_t)y;
   *x += y;
-  *f = FLAG(FLAG_Z(*f), 0, r16 > 0xFFF, r32 > 0xFFFF);
+  cpu->setFlags(FLAG(FLAG_Z(cpu->flags()), 0, r16 > 0xFFF, r32 > 0xFFFF));
 }
 
-void doAnd(uint8_t* x, uint8_t* y, uint8_t* f) {
-  *x &= *y;
-  *f = FLAG(*x == 0, 0, 1, 0);
+void doAnd(uint8_t* x, uint8_t y, CPU* cpu) {
+  *x &= y;
+  cpu->setLazyFlags(CPU::FLAGS_AND, 0, 0, *x, 0);
 }
 
-void doOr(uint8_t* x, uint8_t* y, uint8_t* f) {
-  *x |= *y;
-  *f = FLAG(*x == 0, 0, 0, 0);
+void doOr(uint8_t* x, uint8_t y, CPU* cpu) {
+  *x |= y;
+  cpu->setLazyFlags(CPU::FLAGS_LOGIC, 0, 0, *x, 0);
 }
 
-void doXor(uint8_t* x, uint8_t* y, uint8_t* f) {
-  *x ^= *y;
-  *f = FLAG(*x == 0, 0, 0, 0);
+void doXor(uint8_t* x, uint8_t y, CPU* cpu) {
+  *x ^= y;
+  cpu->setLazyFlags(CPU::FLAGS_LOGIC, 0, 0, *x, 0);
 }
 
-void cp(uint8_t x, uint8_t y, uint8_t* f) {
-  *f = FLAG(x == y, 1, (x & 0xF) < (y & 0xF), x < y);
+void cp(uint8_t x, uint8_t y, CPU* cpu) {
+  cpu->setLazyFlags(CPU::FLAGS_SUB, x, y, 0, 0);
 }
 
-void inc(uint8_t* x, uint8_t* f) {
+void inc(uint8_t* x, CPU* cpu) {
   ++(*x);
-  *f = FLAG(*x == 0, 1, (*x & 0xF) == 0, (*f >> 4) & 1);
+  cpu->setLazyFlags(CPU::FLAGS_INC, 0, 0, *x, cpu->carry());
 }
 
-void dec(uint8_t* x, uint8_t* f) {
+void dec(uint8_t* x, CPU* cpu) {
   --(*x);
-  *f = FLAG(*x == 0, 1, (*x & 0xF) != 0xF, (*f >> 4) & 1);
+  cpu->setLazyFlags(CPU::FLAGS_DEC, 0, 0, *x, cpu->carry());
 }
 
-void rlc(uint8_t* x, uint8_t* f) {
+void rlc(uint8_t* x, CPU* cpu) {
   *x = (*x << 1) | (*x >> 7);
-  *f = FLAG(*x == 0, 0, 0, *x & 1);
+  cpu->setLazyFlags(CPU::FLAGS_SHIFT, 0, 0, *x, *x & 1);
 }
 
-void rl(uint8_t* x, uint8_t* f) {
+void rl(uint8_t* x, CPU* cpu) {
   uint8_t c = (*x >> 7);
-  *x = (*x << 1) | FLAG_C(*f);
-  *f = FLAG(*x == 0, 0, 0, c);
+  *x = (*x << 1) | cpu->carry();
+  cpu->setLazyFlags(CPU::FLAGS_SHIFT, 0, 0, *x, c);
 }
 
-void rrc(uint8_t* x, uint8_t* f) {
-  *f = FLAG(*x == 0, 0, 0, *x & 1);
+void rrc(uint8_t* x, CPU* cpu) {
+  uint8_t c = (*x & 1);
   *x = (*x >> 1) | (*x << 7);
+  cpu->setLazyFlags(CPU::FLAGS_SHIFT, 0, 0, *x, c);
 }
 
-void rr(uint8_t* x, uint8_t* f) {
+void rr(uint8_t* x, CPU* cpu) {
   uint8_t c = (*x & 1);
-  *x = (*x >> 1) | (FLAG_C(*f) << 7);
-  *f = FLAG(*x == 0, 0, 0, c);
+  *x = (*x >> 1) | (cpu->carry() << 7);
+  cpu->setLazyFlags(CPU::FLAGS_SHIFT, 0, 0, *x, c);
 }
 
-void sla(uint8_t* x, uint8_t* f) {
+void sla(uint8_t* x, CPU* cpu) {
   uint8_t c = N_BIT(*x, 7);
   *x <<= 1;
-  *f = FLAG(*x == 0, 0, 0, c);
+  cpu->setLazyFlags(CPU::FLAGS_SHIFT, 0, 0, *x, c);
 }
 
-void sra(uint8_t* x, uint8_t* f) {
+void sra(uint8_t* x, CPU* cpu) {
   uint8_t c = (*x & 1);
   *x = (*x & 0x80) | (*x >> 1);
-  *f = FLAG(*x == 0, 0, 0, c);
+  cpu->setLazyFlags(CPU::FLAGS_SHIFT, 0, 0, *x, c);
 }
 
-void srl(uint8_t* x, uint8_t* f) {
+void srl(uint8_t* x, CPU* cpu) {
   uint8_t c = (*x & 1);
   *x >>= 1;
-  *f = FLAG(*x == 0, 0, 0, c);
+  cpu->setLazyFlags(CPU::FLAGS_SHIFT, 0, 0, *x, c);
 }
 
-void gbSwap(uint8_t* x, uint8_t* f) {
+void gbSwap(uint8_t* x, CPU* cpu) {
   *x = ((*x >> 4) & 0xF) | ((*x << 4) & 0xF0);
-  *f = FLAG(*x == 0, 0, 0, 0);
+  cpu->setLazyFlags(CPU::FLAGS_LOGIC, 0, 0, *x, 0);
 }
 
-void bit(uint8_t x, uint8_t b, uint8_t* f) {
-  *f = FLAG(((x >> b) & 1) == 0, 0, 1, FLAG_C(*f));
+void bit(uint8_t x, uint8_t b, CPU* cpu) {
+  cpu->setLazyFlags(CPU::FLAGS_BIT, 0, 0, (x >> b) & 1, cpu->carry());
 }
 
-void daa(uint8_t* x, uint8_t* f) {
-  int t = 0;
-  uint8_t c = 0;
-  uint8_t h = 0;
-  if(FLAG_H(*f) || ((*x & 0xF) > 9)) {
-    ++t;
-  }
-  if(FLAG_C(*f) || (*x > 0x99)) {
-    t += 2;
-    c = 1;
-  }
-  if (FLAG_N(*f) && !FLAG_H(*f));
-  else if (FLAG_N(*f) && FLAG_H(*f)) {
-    h = (((*x & 0x0F)) < 6);
+// Corrects A to BCD after an addition or subtraction of BCD operands, from
+// the flags it left. Only an addition looks at A itself. H is cleared.
+void daa(uint8_t* x, CPU* cpu) {
+  uint8_t f = cpu->flags();
+  uint8_t c = FLAG_C(f);
+  if (FLAG_N(f)) {
+    if (c)
+      *x -= 0x60;
+    if (FLAG_H(f))
+      *x -= 0x06;
   } else {
-    h = ((*x & 0x0F) >= 0x0A);
-  }
-  switch(t) {
-    case 1:
-      *x += (FLAG_N(*f)) ? 0xFA : 0x06; // -6:6
-      break;
-    case 2:
-      *x += (FLAG_N(*f)) ? 0xA0 : 0x60; // -0x60:0x60
-      break;
-    case 3:
-      *x += (FLAG_N(*f)) ? 0x9A : 0x66; // -0x66:0x66
-      break;
+    if (c || *x > 0x99) {
+      *x += 0x60;
+      c = 1;
+    }
+    if (FLAG_H(f) || (*x & 0x0F) > 0x09)
+      *x += 0x06;
   }
-  *f = FLAG(*x == 0, FLAG_N(*f), h, c);
+  cpu->setFlags(FLAG(*x == 0, FLAG_N(f), 0, c));
 }
 
 uint16_t signExtend16(uint8_t x) {
   return (uint16_t)(int16_t)(int8_t)x;
 }
 
-#define READ_NN              \
-  nn = mem_->read16(reg_.pc); \
-  reg_.pc += 2
-#define READ_N n = mem_->read(reg_.pc++)
+// Operand encodings shared by most opcodes: r8 is op & 0x7 or (op >> 3) & 0x7,
+// r16 is (op >> 4) & 0x3 and cc is (op >> 3) & 0x3.
+enum R8 { R_B, R_C, R_D, R_E, R_H, R_L, R_HL, R_A };
+enum R16 { RR_BC, RR_DE, RR_HL, RR_SP, RR_AF };
+enum COND { CC_NZ, CC_Z, CC_NC, CC_C, CC_ALWAYS };
+enum ALU { ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBC, ALU_AND, ALU_XOR, ALU_OR, ALU_CP };
+enum SHIFT { SH_RLC, SH_RRC, SH_RL, SH_RR, SH_SLA, SH_SRA, SH_SWAP, SH_SRL };
+
+typedef int (*Inst)(CPU* cpu);
+
+// Immediate operands are fetched by the decoder; pc already points past them
+// when a handler runs.
+uint8_t immN(CPU* cpu) {
+  return cpu->imm_ & 0xFF;
+}
+
+uint16_t immNN(CPU* cpu) {
+  return cpu->imm_;
+}
+
+template <int R>
+uint8_t& reg8(CPU::Register& reg) {
+  static_assert(R != R_HL, "(HL) is not a register");
+  if constexpr (R == R_B) return reg.b;
+  if constexpr (R == R_C) return reg.c;
+  if constexpr (R == R_D) return reg.d;
+  if constexpr (R == R_E) return reg.e;
+  if constexpr (R == R_H) return reg.h;
+  if constexpr (R == R_L) return reg.l;
+  if constexpr (R == R_A) return reg.a;
+}
+
+template <int R>
+uint16_t& reg16(CPU::Register& reg) {
+  if constexpr (R == RR_BC) return reg.bc;
+  if constexpr (R == RR_DE) return reg.de;
+  if constexpr (R == RR_HL) return reg.hl;
+  if constexpr (R == RR_SP) return reg.sp;
+  if constexpr (R == RR_AF) return reg.af;
+}
+
+template <int R>
+uint8_t get8(CPU* cpu) {
+  if constexpr (R == R_HL)
+    return cpu->mem_->read(cpu->reg_.hl);
+  else
+    return reg8<R>(cpu->reg_);
+}
+
+template <int R>
+void set8(CPU* cpu, uint8_t datum) {
+  if constexpr (R == R_HL)
+    cpu->mem_->write(cpu->reg_.hl, datum);
+  else
+    reg8<R>(cpu->reg_) = datum;
+}
+
+template <int CC>
+bool cond(uint8_t f) {
+  if constexpr (CC == CC_NZ) return !FLAG_Z(f);
+  if constexpr (CC == CC_Z) return FLAG_Z(f);
+  if constexpr (CC == CC_NC) return !FLAG_C(f);
+  if constexpr (CC == CC_C) return FLAG_C(f);
+  if constexpr (CC == CC_ALWAYS) return true;
+}
+
+int unknownInst(CPU* cpu) {
+  ERR << "Uknown opcode: " << cpu->mem_->read(cpu->reg_.pc - 1) << endl;
+  throw 1;
+}
+
+int unknownCBInst(CPU* cpu) {
+  ERR << "Uknown CB opcode: " << cpu->mem_->read(cpu->reg_.pc - 1) << endl;
+  throw 1;
+}
+
+// ---- 1.x 8-Bit Loads ----
+template <int D, int S>
+int ld(CPU* cpu) {
+  set8<D>(cpu, get8<S>(cpu));
+  return (D == R_HL || S == R_HL) ? 8 : 4;
+}
+
+template <int D>
+int ldImm(CPU* cpu) {
+  set8<D>(cpu, immN(cpu));
+  return D == R_HL ? 12 : 8;
+}
+
+template <int RR>
+int ldAInd(CPU* cpu) {
+  cpu->reg_.a = cpu->mem_->read(reg16<RR>(cpu->reg_));
+  return 8;
+}
+
+template <int RR>
+int ldIndA(CPU* cpu) {
+  cpu->mem_->write(reg16<RR>(cpu->reg_), cpu->reg_.a);
+  return 8;
+}
+
+template <int STEP>
+int ldAHLStep(CPU* cpu) {
+  cpu->reg_.a = cpu->mem_->read(cpu->reg_.hl);
+  cpu->reg_.hl += STEP;
+  return 8;
+}
+
+template <int STEP>
+int ldHLStepA(CPU* cpu) {
+  cpu->mem_->write(cpu->reg_.hl, cpu->reg_.a);
+  cpu->reg_.hl += STEP;
+  return 8;
+}
+
+int ldANN(CPU* cpu) {
+  cpu->reg_.a = cpu->mem_->read(immNN(cpu));
+  return 16;
+}
+
+int ldNNA(CPU* cpu) {
+  cpu->mem_->write(immNN(cpu), cpu->reg_.a);
+  return 16;
+}
+
+int ldhAC(CPU* cpu) {
+  cpu->reg_.a = cpu->mem_->read(0xFF00 | cpu->reg_.c);
+  return 8;
+}
+
+int ldhCA(CPU* cpu) {
+  cpu->mem_->write(0xFF00 | cpu->reg_.c, cpu->reg_.a);
+  return 8;
+}
+
+int ldhNA(CPU* cpu) {
+  cpu->mem_->write(0xFF00 + immN(cpu), cpu->reg_.a);
+  return 12;
+}
+
+int ldhAN(CPU* cpu) {
+  cpu->reg_.a = cpu->mem_->read(0xFF00 + immN(cpu));
+  return 12;
+}
+
+// ---- 2.x 16-Bit Loads ----
+template <int RR>
+int ld16Imm(CPU* cpu) {
+  reg16<RR>(cpu->reg_) = immNN(cpu);
+  return 12;
+}
+
+int ldSPHL(CPU* cpu) {
+  cpu->reg_.sp = cpu->reg_.hl;
+  return 8;
+}
+
+template <int RR>
+int push(CPU* cpu) {
+  if constexpr (RR == RR_AF)
+    cpu->flags();
+  cpu->reg_.sp -= 2;
+  cpu->mem_->write16(cpu->reg_.sp, reg16<RR>(cpu->reg_));
+  return 16;
+}
+
+template <int RR>
+int pop(CPU* cpu) {
+  reg16<RR>(cpu->reg_) = cpu->mem_->read16(cpu->reg_.sp);
+  if constexpr (RR == RR_AF)
+    cpu->setFlags(cpu->reg_.f);
+  cpu->reg_.sp += 2;
+  return 12;
+}
+
+// ---- 3.x 8-Bit ALU ----
+template <int OP>
+void alu(CPU* cpu, uint8_t n) {
+  if constexpr (OP == ALU_ADD) add(&cpu->reg_.a, n, cpu);
+  if constexpr (OP == ALU_ADC) adc(&cpu->reg_.a, n, cpu);
+  if constexpr (OP == ALU_SUB) sub(&cpu->reg_.a, n, cpu);
+  if constexpr (OP == ALU_SBC) sbc(&cpu->reg_.a, n, cpu);
+  if constexpr (OP == ALU_AND) doAnd(&cpu->reg_.a, n, cpu);
+  if constexpr (OP == ALU_XOR) doXor(&cpu->reg_.a, n, cpu);
+  if constexpr (OP == ALU_OR) doOr(&cpu->reg_.a, n, cpu);
+  if constexpr (OP == ALU_CP) cp(cpu->reg_.a, n, cpu);
+}
+
+template <int OP, int S>
+int aluReg(CPU* cpu) {
+  alu<OP>(cpu, get8<S>(cpu));
+  return S == R_HL ? 8 : 4;
+}
+
+template <int OP>
+int aluImm(CPU* cpu) {
+  alu<OP>(cpu, immN(cpu));
+  return 8;
+}
+
+template <int R>
+int inc8(CPU* cpu) {
+  uint8_t n = get8<R>(cpu);
+  inc(&n, cpu);
+  set8<R>(cpu, n);
+  return R == R_HL ? 12 : 4;
+}
+
+template <int R>
+int dec8(CPU* cpu) {
+  uint8_t n = get8<R>(cpu);
+  dec(&n, cpu);
+  set8<R>(cpu, n);
+  return R == R_HL ? 12 : 4;
+}
+
+// ---- 4.x 16-Bit Arithmetic ----
+template <int RR>
+int addHL(CPU* cpu) {
+  add(&cpu->reg_.hl, reg16<RR>(cpu->reg_), cpu);
+  return 8;
+}
+
+template <int RR>
+int inc16(CPU* cpu) {
+  ++reg16<RR>(cpu->reg_);
+  return 8;
+}
+
+template <int RR>
+int dec16(CPU* cpu) {
+  --reg16<RR>(cpu->reg_);
+  return 8;
+}
+
+// ---- 5.x Miscellaneous ----
+int daaA(CPU* cpu) {
+  daa(&cpu->reg_.a, cpu);
+  return 4;
+}
+
+int cpl(CPU* cpu) {
+  cpu->reg_.a = ~cpu->reg_.a;
+  uint8_t f = cpu->flags();
+  cpu->setFlags(FLAG(FLAG_Z(f), 1, 1, FLAG_C(f)));
+  return 4;
+}
+
+int ccf(CPU* cpu) {
+  uint8_t f = cpu->flags();
+  cpu->setFlags(FLAG(FLAG_Z(f), 0, 0, !FLAG_C(f)));
+  return 4;
+}
+
+int scf(CPU* cpu) {
+  cpu->setFlags(FLAG(FLAG_Z(cpu->flags()), 0, 0, 1));
+  return 4;
+}
+
+int nop(CPU* cpu) {
+  return 4;
+}
+
+int halt(CPU* cpu) {
+  cpu->state_ = CPU::HALTED;
+  return 4;
+}
+
+int stop(CPU* cpu) {
+  uint8_t n = immN(cpu);
+  if (n != 0) {
+    ERR << "PC: " << cpu->reg_.pc << endl;
+    throw 1;
+  }
+  cpu->state_ = CPU::STOPPED;
+  return 4;
+}
+
+int di(CPU* cpu) {
+  cpu->mem_->io().disableInterrupt();
+  return 4;
+}
+
+int ei(CPU* cpu) {
+  cpu->mem_->io().enableInterrupt();
+  return 4;
+}
+
+// ---- 6.x Rotates & Shifts ----
+template <int OP>
+void shift(uint8_t* x, CPU* cpu) {
+  if constexpr (OP == SH_RLC) rlc(x, cpu);
+  if constexpr (OP == SH_RRC) rrc(x, cpu);
+  if constexpr (OP == SH_RL) rl(x, cpu);
+  if constexpr (OP == SH_RR) rr(x, cpu);
+  if constexpr (OP == SH_SLA) sla(x, cpu);
+  if constexpr (OP == SH_SRA) sra(x, cpu);
+  if constexpr (OP == SH_SWAP) gbSwap(x, cpu);
+  if constexpr (OP == SH_SRL) srl(x, cpu);
+}
+
+template <int OP>
+int shiftA(CPU* cpu) {
+  shift<OP>(&cpu->reg_.a, cpu);
+  return 4;
+}
+
+template <int OP, int R>
+int shiftCB(CPU* cpu) {
+  uint8_t n = get8<R>(cpu);
+  shift<OP>(&n, cpu);
+  set8<R>(cpu, n);
+  return R == R_HL ? 16 : 8;
+}
+
+template <int B, int R>
+int bitCB(CPU* cpu) {
+  bit(get8<R>(cpu), B, cpu);
+  return R == R_HL ? 12 : 8;
+}
+
+template <int B, int R>
+int resCB(CPU* cpu) {
+  set8<R>(cpu, get8<R>(cpu) & ~(1 << B));
+  return 8;
+}
+
+template <int B, int R>
+int setCB(CPU* cpu) {
+  set8<R>(cpu, get8<R>(cpu) | (1 << B));
+  return 8;
+}
 
-int CPU::executeCBInst_(uint8_t op) {
-  uint8_t n;
+// ---- 8.x Jumps ----
+template <int CC>
+int jp(CPU* cpu) {
+  uint16_t nn = immNN(cpu);
+  if constexpr (CC == CC_ALWAYS) {
+    cpu->reg_.pc = nn;
+    return 12;
+  }
+  if (cond<CC>(cpu->flags())) {
+    cpu->reg_.pc = nn;
+    return 16;
+  }
+  return 12;
+}
+
+int jpHL(CPU* cpu) {
+  // reg_.pc = mem_->read(reg_.hl); ?!?!
+  cpu->reg_.pc = cpu->reg_.hl;
+  return 4;
+}
+
+template <int CC>
+int jr(CPU* cpu) {
+  uint8_t n = immN(cpu);
+  if constexpr (CC == CC_ALWAYS) {
+    cpu->reg_.pc += signExtend16(n);
+    return 8;
+  }
+  if (cond<CC>(cpu->flags())) {
+    cpu->reg_.pc += signExtend16(n);
+    return 12;
+  }
+  return 8;
+}
+
+// ---- 9.x Calls ----
+int call(CPU* cpu) {
+  uint16_t nn = immNN(cpu);
+  cpu->reg_.sp -= 2;
+  cpu->mem_->write16(cpu->reg_.sp, cpu->reg_.pc);
+  cpu->reg_.pc = nn;
+  return 12;
+}
+
+// ---- 10.x Restarts ----
+template <int ADDR>
+int rst(CPU* cpu) {
+  cpu->reg_.sp -= 2;
+  cpu->mem_->write16(cpu->reg_.sp, cpu->reg_.pc);
+  cpu->reg_.pc = ADDR;
+  return 16;
+}
+
+// ---- 11.x Returns ----
+template <int CC>
+int ret(CPU* cpu) {
+  if constexpr (CC == CC_ALWAYS) {
+    cpu->reg_.pc = cpu->mem_->read16(cpu->reg_.sp);
+    cpu->reg_.sp += 2;
+    return 8;
+  }
+  if (cond<CC>(cpu->flags())) {
+    cpu->reg_.pc = cpu->mem_->read16(cpu->reg_.sp);
+    cpu->reg_.sp += 2;
+    return 20;
+  }
+  return 8;
+}
+
+int reti(CPU* cpu) {
+  cpu->reg_.pc = cpu->mem_->read16(cpu->reg_.sp);
+  cpu->reg_.sp += 2;
+  cpu->mem_->io().enableInterrupt();
+  // ERR << "RETI" << endl;
+  return 8;
+}
+
+extern const std::array<Inst, 256> CB_INSTS;
+
+int prefixCB(CPU* cpu) {
+  return CB_INSTS[immN(cpu)](cpu);
+}
+
+template <int OP>
+constexpr Inst decode() {
+  constexpr int X = OP >> 6;
+  constexpr int Y = (OP >> 3) & 0x7;
+  constexpr int Z = OP & 0x7;
+  constexpr int P = Y >> 1;
+  if constexpr (OP == 0x76)
+    return &halt;
+  else if constexpr (X == 1)
+    return &ld<Y, Z>;
+  else if constexpr (X == 2)
+    return &aluReg<Y, Z>;
+  else if constexpr (X == 3 && Z == 6)
+    return &aluImm<Y>;
+  else if constexpr (X == 0 && Z == 4)
+    return &inc8<Y>;
+  else if constexpr (X == 0 && Z == 5)
+    return &dec8<Y>;
+  else if constexpr (X == 0 && Z == 6)
+    return &ldImm<Y>;
+  else if constexpr (X == 0 && Z == 1 && (Y & 1) == 0)
+    return &ld16Imm<P>;
+  else if constexpr (X == 0 && Z == 1)
+    return &addHL<P>;
+  else if constexpr (X == 0 && Z == 3 && (Y & 1) == 0)
+    return &inc16<P>;
+  else if constexpr (X == 0 && Z == 3)
+    return &dec16<P>;
+  else if constexpr (X == 3 && Z == 1 && (Y & 1) == 0)
+    return &pop<P == RR_SP ? RR_AF : P>;
+  else if constexpr (X == 3 && Z == 5 && (Y & 1) == 0)
+    return &push<P == RR_SP ? RR_AF : P>;
+  else if constexpr (X == 3 && Z == 7)
+    return &rst<Y * 8>;
+  else if constexpr (X == 3 && Z == 0 && Y < 4)
+    return &ret<Y>;
+  else if constexpr (X == 3 && Z == 2 && Y < 4)
+    return &jp<Y>;
+  else if constexpr (X == 0 && Z == 0 && Y >= 4)
+    return &jr<Y - 4>;
+  else if constexpr (OP == 0x07)
+    return &shiftA<SH_RLC>;
+  else if constexpr (OP == 0x0F)
+    return &shiftA<SH_RRC>;
+  else if constexpr (OP == 0x17)
+    return &shiftA<SH_RL>;
+  else if constexpr (OP == 0x1F)
+    return &shiftA<SH_RR>;
+  else if constexpr (OP == 0x02)
+    return &ldIndA<RR_BC>;
+  else if constexpr (OP == 0x12)
+    return &ldIndA<RR_DE>;
+  else if constexpr (OP == 0x0A)
+    return &ldAInd<RR_BC>;
+  else if constexpr (OP == 0x1A)
+    return &ldAInd<RR_DE>;
+  else if constexpr (OP == 0x22)
+    return &ldHLStepA<1>;
+  else if constexpr (OP == 0x32)
+    return &ldHLStepA<-1>;
+  else if constexpr (OP == 0x2A)
+    return &ldAHLStep<1>;
+  else if constexpr (OP == 0x3A)
+    return &ldAHLStep<-1>;
+  else if constexpr (OP == 0x00)
+    return &nop;
+  else if constexpr (OP == 0x10)
+    return &stop;
+  else if constexpr (OP == 0x18)
+    return &jr<CC_ALWAYS>;
+  else if constexpr (OP == 0x27)
+    return &daaA;
+  else if constexpr (OP == 0x2F)
+    return &cpl;
+  else if constexpr (OP == 0x37)
+    return &scf;
+  else if constexpr (OP == 0x3F)
+    return &ccf;
+  else if constexpr (OP == 0xC3)
+    return &jp<CC_ALWAYS>;
+  else if constexpr (OP == 0xC9)
+    return &ret<CC_ALWAYS>;
+  else if constexpr (OP == 0xD9)
+    return &reti;
+  else if constexpr (OP == 0xCB)
+    return &prefixCB;
+  else if constexpr (OP == 0xCD)
+    return &call;
+  else if constexpr (OP == 0xE0)
+    return &ldhNA;
+  else if constexpr (OP == 0xF0)
+    return &ldhAN;
+  else if constexpr (OP == 0xE2)
+    return &ldhCA;
+  else if constexpr (OP == 0xF2)
+    return &ldhAC;
+  else if constexpr (OP == 0xEA)
+    return &ldNNA;
+  else if constexpr (OP == 0xFA)
+    return &ldANN;
+  else if constexpr (OP == 0xE9)
+    return &jpHL;
+  else if constexpr (OP == 0xF9)
+    return &ldSPHL;
+  else if constexpr (OP == 0xF3)
+    return &di;
+  else if constexpr (OP == 0xFB)
+    return &ei;
+  else
+    return &unknownInst;
+}
+
+template <int OP>
+constexpr Inst decodeCB() {
+  constexpr int X = OP >> 6;
+  constexpr int Y = (OP >> 3) & 0x7;
+  constexpr int Z = OP & 0x7;
+  if constexpr (X == 0)
+    return &shiftCB<Y, Z>;
+  else if constexpr (X == 1)
+    return &bitCB<Y, Z>;
+  else if constexpr (X == 2)
+    return &resCB<Y, Z>;
+  else
+    return &setCB<Y, Z>;
+}
+
+template <size_t... OP>
+constexpr std::array<Inst, 256> makeInsts(std::index_sequence<OP...>) {
+  return {{decode<OP>()...}};
+}
+
+template <size_t... OP>
+constexpr std::array<Inst, 256> makeCBInsts(std::index_sequence<OP...>) {
+  return {{decodeCB<OP>()...}};
+}
+
+const std::array<Inst, 256> INSTS = makeInsts(std::make_index_sequence<256>());
+const std::array<Inst, 256> CB_INSTS = makeCBInsts(std::make_index_sequence<256>());
+
+uint8_t instLen(uint8_t op) {
   switch (op) {
-    // ---- 5.1 ----
-    case 0x37:
-      gbSwap(&reg_.a, &reg_.f);
-      return 8;
-    case 0x30:
-      gbSwap(&reg_.b, &reg_.f);
-      return 8;
-    case 0x31:
-      gbSwap(&reg_.c, &reg_.f);
-      return 8;
-    case 0x32:
-      gbSwap(&reg_.d, &reg_.f);
-      return 8;
-    case 0x33:
-      gbSwap(&reg_.e, &reg_.f);
-      return 8;
-    case 0x34:
-      gbSwap(&reg_.h, &reg_.f);
-      return 8;
-    case 0x35:
-      gbSwap(&reg_.l, &reg_.f);
-      return 8;
-    case 0x36:
-      n = mem_->read(reg_.hl);
-      gbSwap(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 16;
-      // ---- 6.5 ----
-    case 0x07:
-      rlc(&reg_.a, &reg_.f);
-      return 8;
-    case 0x00:
-      rlc(&reg_.b, &reg_.f);
-      return 8;
-    case 0x01:
-      rlc(&reg_.c, &reg_.f);
-      return 8;
-    case 0x02:
-      rlc(&reg_.d, &reg_.f);
-      return 8;
-    case 0x03:
-      rlc(&reg_.e, &reg_.f);
-      return 8;
-    case 0x04:
-      rlc(&reg_.h, &reg_.f);
-      return 8;
-    case 0x05:
-      rlc(&reg_.l, &reg_.f);
-      return 8;
-    case 0x06:
-      n = mem_->read(reg_.hl);
-      rlc(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 16;
-      // ---- 6.6 ----
-    case 0x17:
-      rl(&reg_.a, &reg_.f);
-      return 8;
-    case 0x10:
-      rl(&reg_.b, &reg_.f);
-      return 8;
-    case 0x11:
-      rl(&reg_.c, &reg_.f);
-      return 8;
-    case 0x12:
-      rl(&reg_.d, &reg_.f);
-      return 8;
-    case 0x13:
-      rl(&reg_.e, &reg_.f);
-      return 8;
-    case 0x14:
-      rl(&reg_.h, &reg_.f);
-      return 8;
-    case 0x15:
-      rl(&reg_.l, &reg_.f);
-      return 8;
-    case 0x16:
-      n = mem_->read(reg_.hl);
-      rl(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 16;
-      // ---- 6.7 ----
-    case 0x0F:
-      rrc(&reg_.a, &reg_.f);
-      return 8;
-    case 0x08:
-      rrc(&reg_.b, &reg_.f);
-      return 8;
-    case 0x09:
-      rrc(&reg_.c, &reg_.f);
-      return 8;
-    case 0x0A:
-      rrc(&reg_.d, &reg_.f);
-      return 8;
-    case 0x0B:
-      rrc(&reg_.e, &reg_.f);
-      return 8;
-    case 0x0C:
-      rrc(&reg_.h, &reg_.f);
-      return 8;
-    case 0x0D:
-      rrc(&reg_.l, &reg_.f);
-      return 8;
-    case 0x0E:
-      n = mem_->read(reg_.hl);
-      rrc(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 16;
-      // ---- 6.8 ----
-    case 0x1F:
-      rr(&reg_.a, &reg_.f);
-      return 8;
-    case 0x18:
-      rr(&reg_.b, &reg_.f);
-      return 8;
-    case 0x19:
-      rr(&reg_.c, &reg_.f);
-      return 8;
-    case 0x1A:
-      rr(&reg_.d, &reg_.f);
-      return 8;
-    case 0x1B:
-      rr(&reg_.e, &reg_.f);
-      return 8;
-    case 0x1C:
-      rr(&reg_.h, &reg_.f);
-      return 8;
-    case 0x1D:
-      rr(&reg_.l, &reg_.f);
-      return 8;
-    case 0x1E:
-      n = mem_->read(reg_.hl);
-      rr(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 16;
-      // ---- 6.9 ----
-    case 0x27:
-      sla(&reg_.a, &reg_.f);
-      return 8;
-    case 0x20:
-      sla(&reg_.b, &reg_.f);
-      return 8;
-    case 0x21:
-      sla(&reg_.c, &reg_.f);
-      return 8;
-    case 0x22:
-      sla(&reg_.d, &reg_.f);
-      return 8;
-    case 0x23:
-      sla(&reg_.e, &reg_.f);
-      return 8;
-    case 0x24:
-      sla(&reg_.h, &reg_.f);
-      return 8;
-    case 0x25:
-      sla(&reg_.l, &reg_.f);
-      return 8;
-    case 0x26:
-      n = mem_->read(reg_.hl);
-      sla(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 16;
-      // ---- 6.10 ----
-    case 0x2F:
-      sra(&reg_.a, &reg_.f);
-      return 8;
-    case 0x28:
-      sra(&reg_.b, &reg_.f);
-      return 8;
-    case 0x29:
-      sra(&reg_.c, &reg_.f);
-      return 8;
-    case 0x2A:
-      sra(&reg_.d, &reg_.f);
-      return 8;
-    case 0x2B:
-      sra(&reg_.e, &reg_.f);
-      return 8;
-    case 0x2C:
-      sra(&reg_.h, &reg_.f);
-      return 8;
-    case 0x2D:
-      sra(&reg_.l, &reg_.f);
-      return 8;
-    case 0x2E:
-      n = mem_->read(reg_.hl);
-      sra(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 16;
-      // ---- 6.11 ----
-    case 0x3F:
-      srl(&reg_.a, &reg_.f);
-      return 8;
-    case 0x38:
-      srl(&reg_.b, &reg_.f);
-      return 8;
-    case 0x39:
-      srl(&reg_.c, &reg_.f);
-      return 8;
-    case 0x3A:
-      srl(&reg_.d, &reg_.f);
-      return 8;
-    case 0x3B:
-      srl(&reg_.e, &reg_.f);
-      return 8;
-    case 0x3C:
-      srl(&reg_.h, &reg_.f);
-      return 8;
-    case 0x3D:
-      srl(&reg_.l, &reg_.f);
-      return 8;
-    case 0x3E:
-      n = mem_->read(reg_.hl);
-      srl(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 16;
-      // BIT
-    case 0x40:
-    case 0x48:
-    case 0x50:
-    case 0x58:
-    case 0x60:
-    case 0x68:
-    case 0x70:
-    case 0x78:
-      bit(reg_.b, (op >> 3) & 0x7, &reg_.f);
-      return 8;
-    case 0x41:
-    case 0x49:
-    case 0x51:
-    case 0x59:
-    case 0x61:
-    case 0x69:
-    case 0x71:
-    case 0x79:
-      bit(reg_.c, (op >> 3) & 0x7, &reg_.f);
-      return 8;
-    case 0x42:
-    case 0x4A:
-    case 0x52:
-    case 0x5A:
-    case 0x62:
-    case 0x6A:
-    case 0x72:
-    case 0x7A:
-      bit(reg_.d, (op >> 3) & 0x7, &reg_.f);
-      return 8;
-    case 0x43:
-    case 0x4B:
-    case 0x53:
-    case 0x5B:
-    case 0x63:
-    case 0x6B:
-    case 0x73:
-    case 0x7B:
-      bit(reg_.e, (op >> 3) & 0x7, &reg_.f);
-      return 8;
-    case 0x44:
-    case 0x4C:
-    case 0x54:
-    case 0x5C:
-    case 0x64:
-    case 0x6C:
-    case 0x74:
-    case 0x7C:
-      bit(reg_.h, (op >> 3) & 0x7, &reg_.f);
-      return 8;
-    case 0x45:
-    case 0x4D:
-    case 0x55:
-    case 0x5D:
-    case 0x65:
-    case 0x6D:
-    case 0x75:
-    case 0x7D:
-      bit(reg_.l, (op >> 3) & 0x7, &reg_.f);
-      return 8;
-    case 0x46:
-    case 0x4E:
-    case 0x56:
-    case 0x5E:
-    case 0x66:
-    case 0x6E:
-    case 0x76:
-    case 0x7E:
-      bit(mem_->read(reg_.hl), (op >> 3) & 0x7, &reg_.f);
-      return 12;
-    case 0x47:
-    case 0x4F:
-    case 0x57:
-    case 0x5F:
-    case 0x67:
-    case 0x6F:
-    case 0x77:
-    case 0x7F:
-      bit(reg_.a, (op >> 3) & 0x7, &reg_.f);
-      return 8;
-      // RESET
-    case 0x80:
-    case 0x88:
-    case 0x90:
-    case 0x98:
-    case 0xA0:
-    case 0xA8:
-    case 0xB0:
-    case 0xB8:
-      reg_.b &= ~(1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0x81:
-    case 0x89:
-    case 0x91:
-    case 0x99:
-    case 0xA1:
-    case 0xA9:
-    case 0xB1:
-    case 0xB9:
-      reg_.c &= ~(1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0x82:
-    case 0x8A:
-    case 0x92:
-    case 0x9A:
-    case 0xA2:
-    case 0xAA:
-    case 0xB2:
-    case 0xBA:
-      reg_.d &= ~(1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0x83:
-    case 0x8B:
-    case 0x93:
-    case 0x9B:
-    case 0xA3:
-    case 0xAB:
-    case 0xB3:
-    case 0xBB:
-      reg_.e &= ~(1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0x84:
-    case 0x8C:
-    case 0x94:
-    case 0x9C:
-    case 0xA4:
-    case 0xAC:
-    case 0xB4:
-    case 0xBC:
-      reg_.h &= ~(1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0x85:
-    case 0x8D:
-    case 0x95:
-    case 0x9D:
-    case 0xA5:
-    case 0xAD:
-    case 0xB5:
-    case 0xBD:
-      reg_.h &= ~(1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0x86:
-    case 0x8E:
-    case 0x96:
-    case 0x9E:
-    case 0xA6:
-    case 0xAE:
-    case 0xB6:
-    case 0xBE:
-      n = mem_->read(reg_.hl);
-      n &= ~(1 << ((op >> 3) & 0x7));
-      mem_->write(reg_.hl, n);
-      return 8;
-    case 0x87:
-    case 0x8F:
-    case 0x97:
-    case 0x9F:
-    case 0xA7:
-    case 0xAF:
-    case 0xB7:
-    case 0xBF:
-      reg_.a &= ~(1 << ((op >> 3) & 0x7));
-      return 8;
-      // SET
-    case 0xC0:
-    case 0xC8:
-    case 0xD0:
-    case 0xD8:
-    case 0xE0:
-    case 0xE8:
-    case 0xF0:
-    case 0xF8:
-      reg_.b |= (1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0xC1:
-    case 0xC9:
-    case 0xD1:
-    case 0xD9:
-    case 0xE1:
-    case 0xE9:
-    case 0xF1:
-    case 0xF9:
-      reg_.c |= (1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0xC2:
-    case 0xCA:
-    case 0xD2:
-    case 0xDA:
-    case 0xE2:
-    case 0xEA:
-    case 0xF2:
-    case 0xFA:
-      reg_.d |= (1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0xC3:
-    case 0xCB:
-    case 0xD3:
-    case 0xDB:
-    case 0xE3:
-    case 0xEB:
-    case 0xF3:
-    case 0xFB:
-      reg_.e |= (1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0xC4:
-    case 0xCC:
-    case 0xD4:
-    case 0xDC:
-    case 0xE4:
-    case 0xEC:
-    case 0xF4:
-    case 0xFC:
-      reg_.h |= (1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0xC5:
-    case 0xCD:
-    case 0xD5:
-    case 0xDD:
-    case 0xE5:
-    case 0xED:
-    case 0xF5:
-    case 0xFD:
-      reg_.l |= (1 << ((op >> 3) & 0x7));
-      return 8;
-    case 0xC6:
-    case 0xCE:
-    case 0xD6:
-    case 0xDE:
-    case 0xE6:
-    case 0xEE:
-    case 0xF6:
-    case 0xFE:
-      n = mem_->read(reg_.hl);
-      n |= (1 << ((op >> 3) & 0x7));
-      mem_->write(reg_.hl, n);
-      return 8;
-    case 0xC7:
-    case 0xCF:
-    case 0xD7:
-    case 0xDF:
-    case 0xE7:
-    case 0xEF:
-    case 0xF7:
-    case 0xFF:
-      reg_.a |= (1 << ((op >> 3) & 0x7));
-      return 8;
+    case 0x01: case 0x08: case 0x11: case 0x21: case 0x31:
+    case 0xC2: case 0xC3: case 0xC4: case 0xCA: case 0xCC: case 0xCD:
+    case 0xD2: case 0xD4: case 0xDA: case 0xDC: case 0xEA: case 0xFA:
+      return 3;
+    case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+    case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+    case 0xCB: case 0xE0: case 0xE8: case 0xF0: case 0xF8:
+      return 2;
+    default:
+      return 1;
+  }
+}
 
+// Whether the instruction may leave straight-line code.
+bool endsBlock(uint8_t op) {
+  switch (op) {
+    case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: case 0x76:
+    case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7: case 0xC8: case 0xC9:
+    case 0xCA: case 0xCC: case 0xCD: case 0xCF: case 0xD0: case 0xD2: case 0xD4:
+    case 0xD7: case 0xD8: case 0xD9: case 0xDA: case 0xDC: case 0xDF: case 0xE7:
+    case 0xE9: case 0xEF: case 0xF7: case 0xFF:
+      return true;
     default:
-      ERR << "Uknown CB opcode: " << op << endl;
-      throw 1;
+      return INSTS[op] == &unknownInst;
   }
 }
 
-int CPU::executeSingleInstInner_() {
-  uint8_t op = mem_->read(reg_.pc++);
-  uint16_t nn;
-  uint8_t n;
-  // ERR << "OP: " << op << endl;
+// Whether the instruction only touches registers and reads memory, so that
+// repeating it cannot change anything outside the CPU.
+bool isPollInst(uint8_t op, uint8_t imm) {
   switch (op) {
-    case 0xC3:  // JP
-      READ_NN;
-      reg_.pc = nn;
-      return 12;
-      // ---- 1.1 ----
-    case 0x06:
-      READ_N;
-      reg_.b = n;
-      return 8;
-    case 0x0E:
-      READ_N;
-      reg_.c = n;
-      return 8;
-    case 0x16:
-      READ_N;
-      reg_.d = n;
-      return 8;
-    case 0x1E:
-      READ_N;
-      reg_.e = n;
-      return 8;
-    case 0x26:
-      READ_N;
-      reg_.h = n;
-      return 8;
-    case 0x2E:
-      READ_N;
-      reg_.l = n;
-      return 8;
-      // ---- 1.2 ----
-    case 0x7F:
-      reg_.a = reg_.a;
-      return 4;
-    case 0x78:
-      reg_.a = reg_.b;
-      return 4;
-    case 0x79:
-      reg_.a = reg_.c;
-      return 4;
-    case 0x7A:
-      reg_.a = reg_.d;
-      return 4;
-    case 0x7B:
-      reg_.a = reg_.e;
-      return 4;
-    case 0x7C:
-      reg_.a = reg_.h;
-      return 4;
-    case 0x7D:
-      reg_.a = reg_.l;
-      return 4;
-    case 0x7E:
-      reg_.a = mem_->read(reg_.hl);
-      return 8;
-    case 0x40:
-      reg_.b = reg_.b;
-      return 4;
-    case 0x41:
-      reg_.b = reg_.c;
-      return 4;
-    case 0x42:
-      reg_.b = reg_.d;
-      return 4;
-    case 0x43:
-      reg_.b = reg_.e;
-      return 4;
-    case 0x44:
-      reg_.b = reg_.h;
-      return 4;
-    case 0x45:
-      reg_.b = reg_.l;
-      return 4;
-    case 0x46:
-      reg_.b = mem_->read(reg_.hl);
-      return 8;
-    case 0x48:
-      reg_.c = reg_.b;
-      return 4;
-    case 0x49:
-      reg_.c = reg_.c;
-      return 4;
-    case 0x4A:
-      reg_.c = reg_.d;
-      return 4;
-    case 0x4B:
-      reg_.c = reg_.e;
-      return 4;
-    case 0x4C:
-      reg_.c = reg_.h;
-      return 4;
-    case 0x4D:
-      reg_.c = reg_.l;
-      return 4;
-    case 0x4E:
-      reg_.c = mem_->read(reg_.hl);
-      return 8;
-    case 0x50:
-      reg_.d = reg_.b;
-      return 4;
-    case 0x51:
-      reg_.d = reg_.c;
-      return 4;
-    case 0x52:
-      reg_.d = reg_.d;
-      return 4;
-    case 0x53:
-      reg_.d = reg_.e;
-      return 4;
-    case 0x54:
-      reg_.d = reg_.h;
-      return 4;
-    case 0x55:
-      reg_.d = reg_.l;
-      return 4;
-    case 0x56:
-      reg_.d = mem_->read(reg_.hl);
-      return 8;
-    case 0x58:
-      reg_.e = reg_.b;
-      return 4;
-    case 0x59:
-      reg_.e = reg_.c;
-      return 4;
-    case 0x5A:
-      reg_.e = reg_.d;
-      return 4;
-    case 0x5B:
-      reg_.e = reg_.e;
-      return 4;
-    case 0x5C:
-      reg_.e = reg_.h;
-      return 4;
-    case 0x5D:
-      reg_.e = reg_.l;
-      return 4;
-    case 0x5E:
-      reg_.e = mem_->read(reg_.hl);
-      return 8;
-    case 0x60:
-      reg_.h = reg_.b;
-      return 4;
-    case 0x61:
-      reg_.h = reg_.c;
-      return 4;
-    case 0x62:
-      reg_.h = reg_.d;
-      return 4;
-    case 0x63:
-      reg_.h = reg_.e;
-      return 4;
-    case 0x64:
-      reg_.h = reg_.h;
-      return 4;
-    case 0x65:
-      reg_.h = reg_.l;
-      return 4;
-    case 0x66:
-      reg_.h = mem_->read(reg_.hl);
-      return 8;
-    case 0x68:
-      reg_.l = reg_.b;
-      return 4;
-    case 0x69:
-      reg_.l = reg_.c;
-      return 4;
-    case 0x6A:
-      reg_.l = reg_.d;
-      return 4;
-    case 0x6B:
-      reg_.l = reg_.e;
-      return 4;
-    case 0x6C:
-      reg_.l = reg_.h;
-      return 4;
-    case 0x6D:
-      reg_.l = reg_.l;
-      return 4;
-    case 0x6E:
-      reg_.l = mem_->read(reg_.hl);
-      return 8;
-    case 0x70:
-      mem_->write(reg_.hl, reg_.b);
-      return 8;
-    case 0x71:
-      mem_->write(reg_.hl, reg_.c);
-      return 8;
-    case 0x72:
-      mem_->write(reg_.hl, reg_.d);
-      return 8;
-    case 0x73:
-      mem_->write(reg_.hl, reg_.e);
-      return 8;
-    case 0x74:
-      mem_->write(reg_.hl, reg_.h);
-      return 8;
-    case 0x75:
-      mem_->write(reg_.hl, reg_.l);
-      return 8;
-    case 0x36:
-      READ_N;
-      mem_->write(reg_.hl, n);
-      return 12;
-      // ---- 1.3 ----
-    case 0x0A:
-      reg_.a = mem_->read(reg_.bc);
-      return 8;
-    case 0x1A:
-      reg_.a = mem_->read(reg_.de);
-      return 8;
-    case 0xFA:
-      READ_NN;
-      reg_.a = mem_->read(nn);
-      return 16;
-    case 0x3E:
-      READ_N;
-      reg_.a = n;
-      return 8;
-      // ---- 1.4 ----
-    case 0x47:
-      reg_.b = reg_.a;
-      return 4;
-    case 0x4F:
-      reg_.c = reg_.a;
-      return 4;
-    case 0x57:
-      reg_.d = reg_.a;
-      return 4;
-    case 0x5F:
-      reg_.e = reg_.a;
-      return 4;
-    case 0x67:
-      reg_.h = reg_.a;
-      return 4;
-    case 0x6F:
-      reg_.l = reg_.a;
-      return 4;
-    case 0x02:
-      mem_->write(reg_.bc, reg_.a);
-      return 8;
-    case 0x12:
-      mem_->write(reg_.de, reg_.a);
-      return 8;
-    case 0x77:
-      mem_->write(reg_.hl, reg_.a);
-      return 8;
-    case 0xEA:
-      READ_NN;
-      mem_->write(nn, reg_.a);
-      return 16;
-      // ---- 1.5 ----
-    case 0xF2:
-      reg_.a = mem_->read(0xFF00 | reg_.c);
-      return 8;
-      // ---- 1.6 ----
-    case 0xE2:
-      mem_->write(0xFF00 | reg_.c, reg_.a);
-      return 8;
-      // ---- 1.9 ---- (1.7 1.8)
-    case 0x3A:
-      reg_.a = mem_->read(reg_.hl--);
-      return 8;
-      // ---- 1.12 ---- (1.10 1.11)
-    case 0x32:
-      mem_->write(reg_.hl--, reg_.a);
-      return 8;
-      // ---- 1.15 ---- (1.13 1.14)
-    case 0x2A:
-      reg_.a = mem_->read(reg_.hl++);
-      return 8;
-      // ---- 1.18 ---- (1.16 1.17)
-    case 0x22:
-      mem_->write(reg_.hl++, reg_.a);
-      return 8;
-      // ---- 1.19 ----
-    case 0xE0:
-      READ_N;
-      mem_->write(0xFF00 + n, reg_.a);
-      return 12;
-      // ---- 1.20 ----
-    case 0xF0:
-      READ_N;
-      reg_.a = mem_->read(0xFF00 + n);
-      return 12;
-      // ---- 2.1 ----
-    case 0x01:
-      READ_NN;
-      reg_.bc = nn;
-      return 12;
-    case 0x11:
-      READ_NN;
-      reg_.de = nn;
-      return 12;
-    case 0x21:
-      READ_NN;
-      reg_.hl = nn;
-      return 12;
-    case 0x31:
-      READ_NN;
-      reg_.sp = nn;
-      return 12;
-      // ---- 2.2 ----
-    case 0xF9:
-      reg_.sp = reg_.hl;
-      return 8;
-      // ---- 2.6 ----
-    case 0xF5:
-      reg_.sp -= 2;
-      mem_->write16(reg_.sp, reg_.af);
-      return 16;
-    case 0xC5:
-      reg_.sp -= 2;
-      mem_->write16(reg_.sp, reg_.bc);
-      return 16;
-    case 0xD5:
-      reg_.sp -= 2;
-      mem_->write16(reg_.sp, reg_.de);
-      return 16;
-    case 0xE5:
-      reg_.sp -= 2;
-      mem_->write16(reg_.sp, reg_.hl);
-      return 16;
-      // ---- 2.7 ----
-    case 0xF1:
-      reg_.af = mem_->read16(reg_.sp);
-      reg_.sp += 2;
-      return 12;
-    case 0xC1:
-      reg_.bc = mem_->read16(reg_.sp);
-      reg_.sp += 2;
-      return 12;
-    case 0xD1:
-      reg_.de = mem_->read16(reg_.sp);
-      reg_.sp += 2;
-      return 12;
-    case 0xE1:
-      reg_.hl = mem_->read16(reg_.sp);
-      reg_.sp += 2;
-      return 12;
-      // ---- 3.1 ----
-    case 0x87:
-      add(&reg_.a, &reg_.a, &reg_.f);
-      return 4;
-    case 0x80:
-      add(&reg_.a, &reg_.b, &reg_.f);
-      return 4;
-    case 0x81:
-      add(&reg_.a, &reg_.c, &reg_.f);
-      return 4;
-    case 0x82:
-      add(&reg_.a, &reg_.d, &reg_.f);
-      return 4;
-    case 0x83:
-      add(&reg_.a, &reg_.e, &reg_.f);
-      return 4;
-    case 0x84:
-      add(&reg_.a, &reg_.h, &reg_.f);
-      return 4;
-    case 0x85:
-      add(&reg_.a, &reg_.l, &reg_.f);
-      return 4;
-    case 0x86:
-      n = mem_->read(reg_.hl);
-      add(&reg_.a, &n, &reg_.f);
-      return 8;
-    case 0xC6:
-      READ_N;
-      add(&reg_.a, &n, &reg_.f);
-      return 8;
-      // ---- 6.2 ----
-    case 0x8F:
-      adc(&reg_.a, reg_.a, &reg_.f);
-      return 4;
-    case 0x88:
-      adc(&reg_.a, reg_.b, &reg_.f);
-      return 4;
-    case 0x89:
-      adc(&reg_.a, reg_.c, &reg_.f);
-      return 4;
-    case 0x8A:
-      adc(&reg_.a, reg_.d, &reg_.f);
-      return 4;
-    case 0x8B:
-      adc(&reg_.a, reg_.e, &reg_.f);
-      return 4;
-    case 0x8C:
-      adc(&reg_.a, reg_.h, &reg_.f);
-      return 4;
-    case 0x8D:
-      adc(&reg_.a, reg_.l, &reg_.f);
-      return 4;
-    case 0x8E:
-      n = mem_->read(reg_.hl);
-      adc(&reg_.a, n, &reg_.f);
-      return 8;
-    case 0xCE:
-      READ_N;
-      adc(&reg_.a, n, &reg_.f);
-      return 8;
-      // ---- 3.3 ----
-    case 0x97:
-      sub(&reg_.a, reg_.a, &reg_.f);
-      return 4;
-    case 0x90:
-      sub(&reg_.a, reg_.b, &reg_.f);
-      return 4;
-    case 0x91:
-      sub(&reg_.a, reg_.c, &reg_.f);
-      return 4;
-    case 0x92:
-      sub(&reg_.a, reg_.d, &reg_.f);
-      return 4;
-    case 0x93:
-      sub(&reg_.a, reg_.e, &reg_.f);
-      return 4;
-    case 0x94:
-      sub(&reg_.a, reg_.h, &reg_.f);
-      return 4;
-    case 0x95:
-      sub(&reg_.a, reg_.l, &reg_.f);
-      return 4;
-    case 0x96:
-      n = mem_->read(reg_.hl);
-      sub(&reg_.a, n, &reg_.f);
-      return 8;
-    case 0xD6:
-      READ_N;
-      sub(&reg_.a, n, &reg_.f);
-      return 8;
-      // ---- 3.4 ----
-    case 0x9F:
-      sbc(&reg_.a, reg_.a, &reg_.f);
-      return 4;
-    case 0x98:
-      sbc(&reg_.a, reg_.b, &reg_.f);
-      return 4;
-    case 0x99:
-      sbc(&reg_.a, reg_.c, &reg_.f);
-      return 4;
-    case 0x9A:
-      sbc(&reg_.a, reg_.d, &reg_.f);
-      return 4;
-    case 0x9B:
-      sbc(&reg_.a, reg_.e, &reg_.f);
-      return 4;
-    case 0x9C:
-      sbc(&reg_.a, reg_.h, &reg_.f);
-      return 4;
-    case 0x9D:
-      sbc(&reg_.a, reg_.l, &reg_.f);
-      return 4;
-    case 0x9E:
-      n = mem_->read(reg_.hl);
-      sbc(&reg_.a, n, &reg_.f);
-      return 8;
-    case 0xDE:
-      READ_N;
-      sbc(&reg_.a, n, &reg_.f);
-      return 8;
-      // ---- 3.5 ----
-    case 0xA7:
-      doAnd(&reg_.a, &reg_.a, &reg_.f);
-      return 4;
-    case 0xA0:
-      doAnd(&reg_.a, &reg_.b, &reg_.f);
-      return 4;
-    case 0xA1:
-      doAnd(&reg_.a, &reg_.c, &reg_.f);
-      return 4;
-    case 0xA2:
-      doAnd(&reg_.a, &reg_.d, &reg_.f);
-      return 4;
-    case 0xA3:
-      doAnd(&reg_.a, &reg_.e, &reg_.f);
-      return 4;
-    case 0xA4:
-      doAnd(&reg_.a, &reg_.h, &reg_.f);
-      return 4;
-    case 0xA5:
-      doAnd(&reg_.a, &reg_.l, &reg_.f);
-      return 4;
-    case 0xA6:
-      n = mem_->read(reg_.hl);
-      doAnd(&reg_.a, &n, &reg_.f);
-      return 8;
-    case 0xE6:
-      READ_N;
-      doAnd(&reg_.a, &n, &reg_.f);
-      return 8;
-      // ---- 3.6 ----
-    case 0xB7:
-      doOr(&reg_.a, &reg_.a, &reg_.f);
-      return 4;
-    case 0xB0:
-      doOr(&reg_.a, &reg_.b, &reg_.f);
-      return 4;
-    case 0xB1:
-      doOr(&reg_.a, &reg_.c, &reg_.f);
-      return 4;
-    case 0xB2:
-      doOr(&reg_.a, &reg_.d, &reg_.f);
-      return 4;
-    case 0xB3:
-      doOr(&reg_.a, &reg_.e, &reg_.f);
-      return 4;
-    case 0xB4:
-      doOr(&reg_.a, &reg_.h, &reg_.f);
-      return 4;
-    case 0xB5:
-      doOr(&reg_.a, &reg_.l, &reg_.f);
-      return 4;
-    case 0xB6:
-      n = mem_->read(reg_.hl);
-      doOr(&reg_.a, &n, &reg_.f);
-      return 8;
-    case 0xF6:
-      READ_N;
-      doOr(&reg_.a, &n, &reg_.f);
-      return 8;
-      // ---- 3.7 ----
-    case 0xAF:
-      doXor(&reg_.a, &reg_.a, &reg_.f);
-      return 4;
-    case 0xA8:
-      doXor(&reg_.a, &reg_.b, &reg_.f);
-      return 4;
-    case 0xA9:
-      doXor(&reg_.a, &reg_.c, &reg_.f);
-      return 4;
-    case 0xAA:
-      doXor(&reg_.a, &reg_.d, &reg_.f);
-      return 4;
-    case 0xAB:
-      doXor(&reg_.a, &reg_.e, &reg_.f);
-      return 4;
-    case 0xAC:
-      doXor(&reg_.a, &reg_.h, &reg_.f);
-      return 4;
-    case 0xAD:
-      doXor(&reg_.a, &reg_.l, &reg_.f);
-      return 4;
-    case 0xAE:
-      n = mem_->read(reg_.hl);
-      doXor(&reg_.a, &n, &reg_.f);
-      return 8;
-    case 0xEE:
-      READ_N;
-      doXor(&reg_.a, &n, &reg_.f);
-      return 8;
-      // ---- 3.8 ----
-    case 0xBF:
-      cp(reg_.a, reg_.a, &reg_.f);
-      return 4;
-    case 0xB8:
-      cp(reg_.a, reg_.b, &reg_.f);
-      return 4;
-    case 0xB9:
-      cp(reg_.a, reg_.c, &reg_.f);
-      return 4;
-    case 0xBA:
-      cp(reg_.a, reg_.d, &reg_.f);
-      return 4;
-    case 0xBB:
-      cp(reg_.a, reg_.e, &reg_.f);
-      return 4;
-    case 0xBC:
-      cp(reg_.a, reg_.h, &reg_.f);
-      return 4;
-    case 0xBD:
-      cp(reg_.a, reg_.l, &reg_.f);
-      return 4;
-    case 0xBE:
-      cp(reg_.a, mem_->read(reg_.hl), &reg_.f);
-      return 8;
-    case 0xFE:
-      READ_N;
-      cp(reg_.a, n, &reg_.f);
-      return 8;
-      // ---- 3.9 ----
-    case 0x3C:
-      inc(&reg_.a, &reg_.f);
-      return 4;
-    case 0x04:
-      inc(&reg_.b, &reg_.f);
-      return 4;
-    case 0x0C:
-      inc(&reg_.c, &reg_.f);
-      return 4;
-    case 0x14:
-      inc(&reg_.d, &reg_.f);
-      return 4;
-    case 0x1C:
-      inc(&reg_.e, &reg_.f);
-      return 4;
-    case 0x24:
-      inc(&reg_.h, &reg_.f);
-      return 4;
-    case 0x2C:
-      inc(&reg_.l, &reg_.f);
-      return 4;
-    case 0x34:
-      n = mem_->read(reg_.hl);
-      inc(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 12;
-      // ---- 3.10 ----
-    case 0x3D:
-      dec(&reg_.a, &reg_.f);
-      return 4;
-    case 0x05:
-      dec(&reg_.b, &reg_.f);
-      return 4;
-    case 0x0D:
-      dec(&reg_.c, &reg_.f);
-      return 4;
-    case 0x15:
-      dec(&reg_.d, &reg_.f);
-      return 4;
-    case 0x1D:
-      dec(&reg_.e, &reg_.f);
-      return 4;
-    case 0x25:
-      dec(&reg_.h, &reg_.f);
-      return 4;
-    case 0x2D:
-      dec(&reg_.l, &reg_.f);
-      return 4;
-    case 0x35:
-      n = mem_->read(reg_.hl);
-      dec(&n, &reg_.f);
-      mem_->write(reg_.hl, n);
-      return 12;
-      // ---- 4.1 ----
-    case 0x09:
-      add(&reg_.hl, reg_.bc, &reg_.f);
-      return 8;
-    case 0x19:
-      add(&reg_.hl, reg_.de, &reg_.f);
-      return 8;
-    case 0x29:
-      add(&reg_.hl, reg_.hl, &reg_.f);
-      return 8;
-    case 0x39:
-      add(&reg_.hl, reg_.sp, &reg_.f);
-      return 8;
-      // ---- 4.3 ----
-    case 0x03:
-      ++ reg_.bc;
-      return 8;
-    case 0x13:
-      ++ reg_.de;
-      return 8;
-    case 0x23:
-      ++ reg_.hl;
-      return 8;
-    case 0x33:
-      ++ reg_.sp;
-      return 8;
-      // ---- 4.4 ----
-    case 0x0B:
-      -- reg_.bc;
-      return 8;
-    case 0x1B:
-      -- reg_.de;
-      return 8;
-    case 0x2B:
-      -- reg_.hl;
-      return 8;
-    case 0x3B:
-      -- reg_.sp;
-      return 8;
-      // ---- 5.2 ----
-    case 0x27:
-      daa(&reg_.a, &reg_.f);
-      return 4;
-      // ---- 5.3 ----
-    case 0x2F:
-      reg_.a = ~reg_.a;
-      reg_.f = FLAG(FLAG_Z(reg_.f),1,1,FLAG_C(reg_.f));
-      return 4;
-      // ---- 5.4 ----
-    case 0x3F:
-      reg_.f = FLAG(FLAG_Z(reg_.f), 0, 0, !FLAG_C(reg_.f));
-      return 4;
-      // ---- 5.5 ----
-    case 0x37:
-      reg_.f = FLAG(FLAG_Z(reg_.f), 0, 0, 1);
-      return 4;
-      // ---- 5.6 ----
-    case 0x00:  // NOP
-      return 4;
-      // ---- 5.8 ----
-    case 0x10:
-      READ_N;
-      if (n != 0) {
-        ERR << "PC: " << reg_.pc << endl;
-        throw 1;
-      }
-      // stop_();
-      return 4;
-      // ---- 5.9 ----
-    case 0xF3:
-      mem_->io().disableInterrupt();
-      return 4;
-      // ---- 5.10 ----
-    case 0xFB:
-      mem_->io().enableInterrupt();
-      return 4;
-      // ---- 6.1 ----
-    case 0x07:
-      rlc(&reg_.a, &reg_.f);
-      return 4;
-      // ---- 6.1 ----
-    case 0x17:
-      rl(&reg_.a, &reg_.f);
-      return 4;
-      // ---- 6.3 ----
-    case 0x0F:
-      rrc(&reg_.a, &reg_.f);
-      return 4;
-      // ---- 6.4 ----
-    case 0x1F:
-      rr(&reg_.a, &reg_.f);
-      return 4;
-      // ---- CB ----
+    case 0x02: case 0x08: case 0x12: case 0x22: case 0x32: case 0x34: case 0x35: case 0x36:
+    case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77:
+    case 0x10: case 0xE0: case 0xE2: case 0xEA: case 0xF3: case 0xFB:
+      return false;
     case 0xCB:
-      READ_N;
-      return executeCBInst_(n);
-      // ---- 8.2 ----
-    case 0xC2:
-      READ_NN;
-      if (!FLAG_Z(reg_.f)) {
-        reg_.pc = nn;
-        return 16;
-      }
-      return 12;
-    case 0xCA:
-      READ_NN;
-      if (FLAG_Z(reg_.f)) {
-        reg_.pc = nn;
-        return 16;
-      }
-      return 12;
-    case 0xD2:
-      READ_NN;
-      if (!FLAG_C(reg_.f)) {
-        reg_.pc = nn;
-        return 16;
-      }
-      return 12;
-    case 0xDA:
-      READ_NN;
-      if (FLAG_C(reg_.f)) {
-        reg_.pc = nn;
-        return 16;
-      }
-      return 12;
-      // ---- 8.3 ----
-    case 0xE9:
-      // reg_.pc = mem_->read(reg_.hl); ?!?!
-      reg_.pc = reg_.hl;
-      return 4;
-      // ---- 8.4 ----
-    case 0x18:
-      READ_N;
-      reg_.pc += signExtend16(n);
-      return 8;
-      // ---- 8.5 ----
-    case 0x20:
-      READ_N;
-      if (!FLAG_Z(reg_.f)) {
-        reg_.pc += signExtend16(n);
-        return 12;
-      }
-      return 8;
-    case 0x28:
-      READ_N;
-      if (FLAG_Z(reg_.f)) {
-        reg_.pc += signExtend16(n);
-        return 12;
-      }
-      return 8;
-    case 0x30:
-      READ_N;
-      if (!FLAG_C(reg_.f)) {
-        reg_.pc += signExtend16(n);
-        return 12;
-      }
-      return 8;
-    case 0x38:
-      READ_N;
-      if (FLAG_C(reg_.f)) {
-        reg_.pc += signExtend16(n);
-        return 12;
-      }
-      return 8;
-      // ---- 9.1 ----
-    case 0xCD:
-      READ_NN;
-      reg_.sp -= 2;
-      mem_->write16(reg_.sp, reg_.pc);
-      reg_.pc = nn;
-      return 12;
-      // ---- 10.1 ----
-    case 0xC7:
-    case 0xCF:
-    case 0xD7:
-    case 0xDF:
-    case 0xE7:
-    case 0xEF:
-    case 0xF7:
-    case 0xFF:
-      reg_.sp -= 2;
-      mem_->write16(reg_.sp, reg_.pc);
-      reg_.pc = op - 0xC7;
-      return 16;
-      // ---- 11.1 ----
-    case 0xC9:
-      reg_.pc = mem_->read16(reg_.sp);
-      reg_.sp += 2;
-      return 8;
-      // ---- 11.2 ----
-    case 0xC0:
-      if (!FLAG_Z(reg_.f)) {
-        reg_.pc = mem_->read16(reg_.sp);
-        reg_.sp += 2;
-        return 20;
-      }
-      return 8;
-    case 0xC8:
-      if (FLAG_Z(reg_.f)) {
-        reg_.pc = mem_->read16(reg_.sp);
-        reg_.sp += 2;
-        return 20;
-      }
-      return 8;
-    case 0xD0:
-      if (!FLAG_C(reg_.f)) {
-        reg_.pc = mem_->read16(reg_.sp);
-        reg_.sp += 2;
-        return 20;
-      }
-      return 8;
-    case 0xD8:
-      if (FLAG_C(reg_.f)) {
-        reg_.pc = mem_->read16(reg_.sp);
-        reg_.sp += 2;
-        return 20;
-      }
-      return 8;
-      // ---- 11.3 ----
-    case 0xD9:
-      reg_.pc = mem_->read16(reg_.sp);
-      reg_.sp += 2;
-      mem_->io().enableInterrupt();
-      // ERR << "RETI" << endl;
-      return 8;
+      return (imm & 0x7) != R_HL || (imm >> 6) == 1;
+    default:
+      // PUSH and POP; other stack users end the block anyway.
+      return (op & 0xCB) != 0xC1;
+  }
+}
 
+// Target of a JR/JP at pc, or -1 if op is not one.
+int branchTarget(uint8_t op, uint16_t pc, uint16_t imm) {
+  switch (op) {
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+      return (uint16_t)(pc + 2 + signExtend16(imm));
+    case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA:
+      return imm;
     default:
-      ERR << "Uknown opcode: " << op << endl;
-      throw 1;
+      return -1;
   }
 }
 
+void CPU::decodeInst_(uint16_t pc, DecodedInst* out) {
+  uint8_t op = mem_->read(pc);
+  out->pc = pc;
+  out->len = instLen(op);
+  if (out->len == 3)
+    out->imm = mem_->read16(pc + 1);
+  else if (out->len == 2)
+    out->imm = mem_->read(pc + 1);
+  else
+    out->imm = 0;
+  out->inst = (op == 0xCB ? CB_INSTS[out->imm] : INSTS[op]);
+}
+
+CPU::Block* CPU::lookupBlock_(uint16_t pc) {
+  // Only ROM, WRAM and HRAM code is cached. Blocks never cross a ROM bank,
+  // and never a 256-byte page in RAM so one write generation covers them.
+  uint32_t end;
+  if (pc < 0x4000)
+    end = 0x4000;
+  else if (pc < 0x8000)
+    end = 0x8000;
+  else if (pc >= 0xC000 && pc < 0xE000)
+    end = (pc | 0xFF) + 1;
+  else if (pc >= 0xFF80 && pc < 0xFFFF)
+    end = 0xFFFF;
+  else
+    return nullptr;
+
+  if (blocks_ == nullptr) {
+    blocks_ = static_cast<Block*>(arenaAlloc(sizeof(Block) * BLOCK_SLOTS));
+    for (int i = 0; i < BLOCK_SLOTS; ++i)
+      blocks_[i].key = 0xFFFFFFFF;
+  }
+  const uint32_t* tag = &mem_->codeTag(pc);
+  uint32_t key = (pc >= 0x4000 && pc < 0x8000 ? *tag << 16 : 0) | pc;
+  Block* block = &blocks_[((key * 2654435761u) >> 16) & (BLOCK_SLOTS - 1)];
+  if (block->key == key && block->tag == tag && block->tagValue == *tag)
+    return block;
+
+  block->key = key;
+  block->tag = tag;
+  block->tagValue = *tag;
+  block->size = 0;
+  block->idleLoop = false;
+  bool poll = true;
+  uint32_t addr = pc;
+  while (block->size < BLOCK_INSTS) {
+    uint8_t op = mem_->read(addr);
+    if (addr + instLen(op) > end)
+      break;
+    DecodedInst* inst = &block->insts[block->size++];
+    decodeInst_(addr, inst);
+    addr += inst->len;
+    if (endsBlock(op)) {
+      block->idleLoop = poll && branchTarget(op, inst->pc, inst->imm) == pc;
+      break;
+    }
+    poll = poll && isPollInst(op, inst->imm);
+  }
+  if (block->size == 0) {
+    block->key = 0xFFFFFFFF;
+    return nullptr;
+  }
+  return block;
+}
+
+int CPU::executeSingleInstInner_() {
+  if (block_ == nullptr || blockIdx_ >= block_->size ||
+      block_->insts[blockIdx_].pc != reg_.pc || *block_->tag != block_->tagValue) {
+    block_ = lookupBlock_(reg_.pc);
+    blockIdx_ = 0;
+    passCycles_ = 0;
+    passEvents_ = mem_->io().events;
+    idleLoop_ = 0;
+  }
+  const DecodedInst* inst;
+  if (block_ != nullptr) {
+    inst = &block_->insts[blockIdx_++];
+  } else {
+    decodeInst_(reg_.pc, &scratch_);
+    inst = &scratch_;
+  }
+  // ERR << "OP: " << mem_->read(reg_.pc) << endl;
+  reg_.pc += inst->len;
+  imm_ = inst->imm;
+  int cycles = inst->inst(this);
+  passCycles_ += cycles;
+  if (block_ != nullptr && block_->idleLoop && blockIdx_ == block_->size)
+    checkIdleLoop_();
+  return cycles;
+}
+
+void CPU::checkIdleLoop_() {
+  // The block only reads memory and jumps back to its start. If a pass ran
+  // between two events and left every register as it found them, all
+  // further passes are identical until an event changes what the loop
+  // reads. DIV and TIMA change between events, so loops reading them do not
+  // count.
+  IO& io = mem_->io();
+  flags();
+  bool timerRead = io.timerRead;
+  io.timerRead = false;
+  if (reg_.pc == block_->insts[0].pc && !timerRead && io.events == passEvents_ &&
+      (io.reg(IO::IME) & io.reg(IO::IF) & io.reg(IO::IE) & 0x1F) == 0 &&
+      memcmp(&reg_, &idleRegs_, sizeof(reg_)) == 0) {
+    idleLoop_ = passCycles_;
+  }
+  idleRegs_ = reg_;
+}
+
 int CPU::executeSingleInst() {
+  if (state_ != RUNNING) {
+    // HALT wakes on any enabled interrupt, STOP only on a joypad press.
+    IO& io = mem_->io();
+    uint8_t wake = (state_ == HALTED ? io.reg(IO::IE) : 1 << IO::IRQ_JOYPAD);
+    if ((io.reg(IO::IF) & wake & 0x1F) == 0)
+      return 4;
+    state_ = RUNNING;
+  }
   uint16_t interruptAddr = mem_->io().acknowledgeInterrupt();
   if (interruptAddr != 0xFFFF) {
     // ERR << "Interrupt ! " << interruptAddr << endl;
@@ -1520,3 +982,17 @@ int CPU::executeSingleInst() {
   }
   return executeSingleInstInner_();
 }
+
+void CPU::serialize(Snapshot* state) {
+  state->field(reg_);
+  state->field(lazyFlags_);
+  state->field(state_);
+  if (state->loading()) {
+    // Decoded blocks stay valid, Memory bumps the code tags of everything it
+    // loads. Only the position inside the current block is dropped.
+    block_ = nullptr;
+    blockIdx_ = 0;
+    passCycles_ = 0;
+    idleLoop_ = 0;
+  }
+}
@@ -4,27 +4,342 @@
 #include "memory.h"
 #include "log.h"
 
-#include <emscripten.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
 
 const int CYCLE_PER_SECOND = 4194304;
 const int FPS = 64;
 const int CYCLE_PER_FRAME = CYCLE_PER_SECOND / FPS;
 
-Gameboy::Gameboy(uint8_t* romData, int canvasId)
-    : io_(&mem_, &video_), mem_(Cartridge(romData), &io_), video_(&io_, canvasId), timer_(&io_), cpu_(&mem_), isRunning_(false), timing_(0) {
+// romData is the caller's no more, so it is freed if it is rejected.
+static Cartridge ownedCartridge(uint8_t* romData, size_t size) {
+  try {
+    return Cartridge(romData, size);
+  } catch (...) {
+    free(romData);
+    throw;
+  }
+}
+
+Gameboy::Gameboy(uint8_t* romData, size_t size, int canvasId) : Gameboy(ownedCartridge(romData, size), canvasId) {}
+
+Gameboy::Gameboy(Cartridge&& cart, int canvasId)
+    : io_(&mem_, &video_, &timer_), mem_(std::move(cart), &io_), video_(&io_, &mem_, &sched_, canvasId), timer_(&io_, &sched_), cpu_(&mem_), isRunning_(false), frameEnd_(0), idleCycles_(0), rewind_(nullptr), maxSkip_(0), skip_(0), skipBudget_(0), frameTime_(0), framesSinceSkipChange_(0), headless_(false), shownMaxSkip_(0), shownSkipBudget_(0) {
   ERR.set(&cpu_);
   ERR.set(&mem_);
 }
 
+Gameboy::Gameboy(Gameboy* parent)
+    : io_(&mem_, &video_, &timer_, &parent->io_), mem_(parent->mem_.cart().fork(), &io_, &parent->mem_), video_(&io_, &mem_, &sched_, 0, &parent->video_), timer_(&io_, &sched_), cpu_(&mem_), isRunning_(false), frameEnd_(0), idleCycles_(parent->idleCycles_), rewind_(nullptr), maxSkip_(parent->maxSkip_), skip_(parent->skip_), skipBudget_(parent->skipBudget_), frameTime_(parent->frameTime_), framesSinceSkipChange_(parent->framesSinceSkipChange_), headless_(parent->headless_), shownMaxSkip_(parent->shownMaxSkip_), shownSkipBudget_(parent->shownSkipBudget_) {
+  // Memory is shared and the picture copied already; the rest of the state
+  // goes over as it does for run-ahead.
+  Snapshot size;
+  size.skipBulk();
+  parent->serialize_(&size);
+  checkpoint_.resize(size.size());
+  Snapshot save(checkpoint_.data(), checkpoint_.size());
+  save.skipBulk();
+  parent->serialize_(&save);
+  Snapshot load(static_cast<const uint8_t*>(checkpoint_.data()), checkpoint_.size());
+  load.skipBulk();
+  serialize_(&load);
+}
+
+Gameboy* Gameboy::fork() {
+  return new Gameboy(this);
+}
+
+Gameboy::~Gameboy() {
+  delete rewind_;
+}
+
 void Gameboy::executeSingleFrame(uint8_t joypad) {
+  if (skipBudget_ > 0) {
+    auto start = std::chrono::steady_clock::now();
+    runFrame_(joypad);
+    updateFrameSkip_(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  } else {
+    runFrame_(joypad);
+  }
+  pushRewind_();
+}
+
+void Gameboy::pushRewind_() {
+  if (rewind_ != nullptr) {
+    saveState(rewind_->next(), stateSize());
+    rewind_->push();
+  }
+}
+
+size_t Gameboy::frameRecordSize(uint32_t flags) {
+  return ((flags & EXEC_HASH) ? sizeof(uint64_t) : 0) + ((flags & EXEC_WRAM) ? 0x2000 : 0) +
+         ((flags & EXEC_PICTURE) ? 144 * 160 : 0);
+}
+
+void Gameboy::pictureShades(uint8_t* out) const {
+  const uint8_t* frame = reinterpret_cast<const uint8_t*>(video_.frame());
+  if (frame == nullptr) {
+    memset(out, 0, 144 * 160);
+    return;
+  }
+  for (int p = 0; p < 144 * 160; ++p)
+    out[p] = frame[p * 4];
+}
+
+int Gameboy::executeFrames(int n, const uint8_t* inputs, uint32_t flags, uint8_t* out, size_t size) {
+  if (n <= 0)
+    return 0;
+  size_t record = frameRecordSize(flags);
+  if (record != 0)
+    n = std::min<size_t>(n, size / record);
+  bool hash = flags & EXEC_HASH;
+  bool picture = flags & EXEC_PICTURE;
+  bool show = flags & (EXEC_SHOW_LAST | EXEC_KEEP_LAST);
+  uint8_t last = (flags & EXEC_SHOW_LAST) ? Video::OUTPUT_CANVAS : Video::OUTPUT_FRAME;
+  // A picture takes lines from up to three frames. Shown, only one ending in
+  // the last frame counts; kept, also one ending in the frame before, as
+  // there is not a picture in every frame but in every two there is.
+  int keepFrom = (flags & EXEC_SHOW_LAST) ? n - 1 : n - 2;
+  uint8_t target = video_.outputTarget();
+  for (int i = 0; i < n; ++i) {
+    // Only pictures that are hashed or recorded get drawn, plus those that
+    // end up shown or kept.
+    uint8_t output = (hash ? Video::OUTPUT_HASH : 0) | (picture ? Video::OUTPUT_FRAME : 0);
+    bool present = true;
+    if (show && i >= keepFrom) {
+      output |= last;
+    } else if (show && i >= keepFrom - 2 && !hash && !picture) {
+      output = last;
+      present = false;
+    }
+    video_.setOutputTarget(output);
+    video_.setOutput(true, present);
+    runFrame_(inputs[(flags & EXEC_HOLD_INPUT) ? 0 : i]);
+    pushRewind_();
+    if (hash) {
+      memcpy(out, &video_.frameHash(), sizeof(uint64_t));
+      out += sizeof(uint64_t);
+    }
+    if (flags & EXEC_WRAM) {
+      mem_.copyWorkRam(out);
+      out += 0x2000;
+    }
+    if (picture) {
+      pictureShades(out);
+      out += 144 * 160;
+    }
+  }
+  video_.setOutputTarget(target);
+  video_.setOutput(true, true);
+  return n;
+}
+
+void Gameboy::setFrameSkip(int maxSkip, double budgetMs) {
+  maxSkip_ = std::max(maxSkip, 0);
+  skipBudget_ = budgetMs;
+  skip_ = budgetMs > 0 ? std::min(skip_, maxSkip_) : maxSkip_;
+  frameTime_ = 0;
+  framesSinceSkipChange_ = 0;
+  video_.setFrameSkip(skip_);
+}
+
+void Gameboy::setHeadless(bool headless, bool hash, int every) {
+  if (!headless) {
+    video_.setOutputTarget(Video::OUTPUT_CANVAS);
+    if (headless_)
+      setFrameSkip(shownMaxSkip_, shownSkipBudget_);
+    headless_ = false;
+    return;
+  }
+  if (!headless_) {
+    shownMaxSkip_ = maxSkip_;
+    shownSkipBudget_ = skipBudget_;
+  }
+  headless_ = true;
+  video_.setOutputTarget(hash ? Video::OUTPUT_HASH : Video::OUTPUT_NONE);
+  setFrameSkip(std::max(every, 1) - 1, 0);
+}
+
+void Gameboy::updateFrameSkip_(double ms) {
+  // Average over about 8 frames, so that drawn and skipped ones even out.
+  frameTime_ += (ms - frameTime_) / 8;
+  // Give each change a few drawn pictures to show in the average.
+  if (++framesSinceSkipChange_ < 4 * (skip_ + 1))
+    return;
+  int skip = skip_;
+  if (frameTime_ > skipBudget_ && skip_ < maxSkip_)
+    ++skip;
+  else if (frameTime_ < skipBudget_ * 0.75 && skip_ > 0)
+    --skip;
+  if (skip == skip_)
+    return;
+  skip_ = skip;
+  framesSinceSkipChange_ = 0;
+  video_.setFrameSkip(skip_);
+}
+
+void Gameboy::runFrame_(uint8_t joypad) {
+  ERR.set(&cpu_);
+  ERR.set(&mem_);
   io_.setJoypad(joypad);
 
-  timing_ += CYCLE_PER_FRAME;
-  while (timing_ > 0) {
-    int cycle = cpu_.executeSingleInst();
-    video_.runCycles(cycle);
-    timer_.runCycles(cycle);
-    timing_ -= cycle;
+  frameEnd_ += CYCLE_PER_FRAME;
+  sched_.schedule(Scheduler::EVENT_FRAME, frameEnd_);
+  bool frameDone = false;
+  while (!frameDone) {
+    // Run the CPU uninterrupted up to the earliest deadline.
+    while (sched_.now() < sched_.next()) {
+      int cycle = cpu_.executeSingleInst();
+      uint64_t next = sched_.next() - sched_.now();
+      if (cpu_.halted()) {
+        // Only an interrupt can wake the CPU, so jump straight to the next
+        // event that may raise one instead of idling 4 cycles at a time.
+        cycle = std::max<uint64_t>(cycle, next);
+      } else if (cpu_.idleLoopCycles() != 0 && next > (uint64_t)cycle) {
+        // The CPU polls memory that only an event can change: skip the loop
+        // iterations that finish before the next one.
+        int loop = cpu_.idleLoopCycles();
+        int skip = std::min<uint64_t>((next - 1 - cycle) / loop, INT32_MAX / loop) * loop;
+        cycle += skip;
+        idleCycles_ += skip;
+      }
+      sched_.advance(cycle);
+    }
+
+    Scheduler::Event event;
+    uint64_t at;
+    while (sched_.pop(&event, &at)) {
+      switch (event) {
+        case Scheduler::EVENT_VIDEO:
+          video_.onEvent(at);
+          break;
+        case Scheduler::EVENT_TIMER:
+          timer_.onEvent();
+          break;
+        case Scheduler::EVENT_FRAME:
+          frameDone = true;
+          break;
+        default:
+          break;
+      }
+    }
   }
   // ERR.pc().mem(0xFFE1) << " " << io_.reg(IO::LCDC) << endl;
 }
+
+void Gameboy::runAhead(uint8_t joypad, int frames) {
+  if (frames <= 0) {
+    executeSingleFrame(joypad);
+    return;
+  }
+  // A picture is drawn over 70224 cycles and shown 4560 cycles after its last
+  // line, so it can take lines from the last three 65536-cycle frames; only
+  // those render.
+  video_.setOutput(frames <= 2, false);
+  runFrame_(joypad);
+
+  Snapshot size;
+  size.skipBulk();
+  serialize_(&size);
+  checkpoint_.resize(size.size());
+  Snapshot save(checkpoint_.data(), checkpoint_.size());
+  save.skipBulk();
+  serialize_(&save);
+  mem_.checkpoint();
+  video_.checkpoint();
+  uint64_t idleCycles = idleCycles_;
+
+  for (int i = 1; i <= frames; ++i) {
+    video_.setOutput(i >= frames - 2, i == frames);
+    runFrame_(joypad);
+  }
+
+  Snapshot load(static_cast<const uint8_t*>(checkpoint_.data()), checkpoint_.size());
+  load.skipBulk();
+  serialize_(&load);
+  mem_.restore();
+  video_.restore();
+  idleCycles_ = idleCycles;
+  video_.setOutput(true, true);
+  pushRewind_();
+}
+
+const uint32_t STATE_MAGIC = 0x54534247;  // "GBST"
+const uint32_t STATE_VERSION = 1;
+
+void Gameboy::serialize_(Snapshot* state) {
+  uint32_t header[3] = {STATE_MAGIC, STATE_VERSION, mem_.cart().checksum()};
+  state->field(header);
+  sched_.serialize(state);
+  cpu_.serialize(state);
+  mem_.serialize(state);
+  io_.serialize(state);
+  video_.serialize(state);
+  timer_.serialize(state);
+  state->field(frameEnd_);
+}
+
+size_t Gameboy::stateSize() {
+  Snapshot state;
+  serialize_(&state);
+  return state.size();
+}
+
+size_t Gameboy::saveState(uint8_t* buf, size_t size) {
+  Snapshot state(buf, size);
+  if (size < stateSize())
+    return 0;
+  serialize_(&state);
+  return state.size();
+}
+
+bool Gameboy::loadState(const uint8_t* buf, size_t size) {
+  uint32_t header[3];
+  Snapshot check(buf, size);
+  check.field(header);
+  if (size != stateSize() || header[0] != STATE_MAGIC || header[1] != STATE_VERSION ||
+      header[2] != mem_.cart().checksum()) {
+    ERR << "Save state does not match this ROM or version" << endl;
+    return false;
+  }
+  Snapshot state(buf, size);
+  serialize_(&state);
+  return true;
+}
+
+void Gameboy::setRewind(int frames, size_t budget) {
+  delete rewind_;
+  rewind_ = nullptr;
+  if (frames <= 0)
+    return;
+  rewind_ = new Rewind(stateSize(), frames, budget);
+  saveState(rewind_->next(), stateSize());
+  rewind_->push();
+}
+
+int Gameboy::rewind(int frames) {
+  if (rewind_ == nullptr)
+    return 0;
+  int n = rewind_->rewind(frames);
+  if (n != 0)
+    loadState(rewind_->last(), stateSize());
+  return n;
+}
+
+const std::vector<uint32_t>& Gameboy::takeSaveRanges() {
+  saveRanges_.clear();
+  if (mem_.cart().saveDirty()) {
+    mem_.cart().takeDirtyRanges(&saveRanges_);
+    mem_.remapCartRam();
+  }
+  return saveRanges_;
+}
+
+#ifndef __EMSCRIPTEN__
+void Gameboy::flushSave() {
+  mem_.cart().writeSave(takeSaveRanges());
+}
+#endif
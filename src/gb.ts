@@ -2,6 +2,39 @@ export default interface GB extends Record<string, WebAssembly.ExportValue> {
   memory: WebAssembly.Memory;
   malloc(size: number): number;
   free(ptr: number): void;
-  createGameboy(rom: number, canvasId: number): number;
+  createGameboy(rom: number, size: number, canvasId: number): number;
+  forkGameboy(gb: number): number;
+  deleteGameboy(gb: number): void;
+  getRegisteredRoms(): number;
   runGameboy(gb: number): boolean;
+  getCycles(gb: number): number;
+  getIdleCycles(gb: number): number;
+  isSaveDirty(gb: number): number;
+  getSaveRam(gb: number): number;
+  getSaveRamSize(gb: number): number;
+  takeSaveRanges(gb: number): number;
+  getSaveRanges(gb: number): number;
+  getStateSize(gb: number): number;
+  saveState(gb: number, buf: number, size: number): number;
+  loadState(gb: number, buf: number, size: number): number;
+  executeFrames(gb: number, n: number, inputs: number, flags: number, out: number, size: number): number;
+  getFrameRecordSize(flags: number): number;
+  runAhead(gb: number, joypad: number, frames: number): void;
+  setRewind(gb: number, frames: number, budget: number): void;
+  rewindFrames(gb: number, frames: number): number;
+  setBackgroundCache(gb: number, on: number): void;
+  getFrameBuffer(gb: number): number;
+  getFrameBuffers(gb: number): number;
+  setColors(gb: number, c0: number, c1: number, c2: number, c3: number): void;
+  setFrameSkip(gb: number, maxSkip: number, budgetMs: number): void;
+  getFrameSkip(gb: number): number;
+  setHeadless(gb: number, headless: number, hash: number, every: number): void;
+  getFrameHash(gb: number): number;
+  createBatch(rom: number, size: number, count: number): number;
+  deleteBatch(batch: number): void;
+  setBatchObservation(batch: number, addrs: number, n: number, flags: number): void;
+  getBatchObservationSize(batch: number): number;
+  setBatchDone(batch: number, addr: number, mask: number, value: number): void;
+  stepBatch(batch: number, actions: number, frames: number, out: number): void;
+  resetBatch(batch: number, i: number): void;
 }
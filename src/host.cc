@@ -0,0 +1,18 @@
+#ifndef __EMSCRIPTEN__
+#include <stdint.h>
+
+#include "canvas.h"
+#include "log.h"
+
+#include <cstdio>
+
+// Natively there is no JS side to import these from: log lines go to
+// stderr, and finished frames are left for Gameboy::frame() to read.
+extern "C" {
+void printAsciiBuffer(const char* buf) {
+  fprintf(stderr, "%s\n", buf);
+}
+
+void renderCanvas(int canvasId, uint8_t* rgba) {}
+}
+#endif
@@ -13,6 +13,20 @@ const clock_gettime = (clk_id: number, tp: number): number => {
   return 0;
 };
 
+// Persistent ImageData over each of the core's two frame buffers, so that
+// showing a frame copies nothing in JS. Views go stale when memory grows.
+const frameImages = new Map<number, ImageData>();
+let ctx: CanvasRenderingContext2D | null = null;
+
+const frameImage = (buf: number): ImageData => {
+  let img = frameImages.get(buf);
+  if (!img) {
+    img = new ImageData(new Uint8ClampedArray(inst!.memory.buffer, buf, 160 * 144 * 4), 160, 144);
+    frameImages.set(buf, img);
+  }
+  return img;
+};
+
 let lastGrowTimestamp = 0;
 const emscripten_notify_memory_growth = (idx: number) => {
   if (lastGrowTimestamp) {
@@ -22,25 +36,17 @@ const emscripten_notify_memory_growth = (idx: number) => {
   HEAP8 = new Int8Array(inst!.memory.buffer);
   HEAPU8 = new Uint8Array(inst!.memory.buffer);
   HEAP32 = new Int32Array(inst!.memory.buffer);
+  frameImages.clear();
 };
 
 const importObj = {
   env: {
     renderCanvas: (canvasId: number, buf: number) => {
-      const canvas = <HTMLCanvasElement> document.getElementById('canvas');
-      const ctx = <CanvasRenderingContext2D> canvas.getContext('2d');
-      ctx.fillStyle = '#FF0000';
-      ctx.fillRect(0, 0, 160, 144);
-      const imgData = ctx.createImageData(160, 144);
-      for (let i = 0; i < 144 * 160; ++i) {
-        const idx = i * 4;
-        const datum = HEAPU8[buf + i];
-        imgData.data[idx] = datum;
-        imgData.data[idx + 1] = datum;
-        imgData.data[idx + 2] = datum;
-        imgData.data[idx + 3] = 255;
+      if (!ctx) {
+        const canvas = <HTMLCanvasElement> document.getElementById('canvas');
+        ctx = <CanvasRenderingContext2D> canvas.getContext('2d');
       }
-      ctx.putImageData(imgData, 0, 0);
+      ctx.putImageData(frameImage(buf), 0, 0);
     },
     clock_gettime,
     emscripten_notify_memory_growth,
@@ -79,6 +85,22 @@ export const getInstance = async (): Promise<GB> => {
   return await instPromise;
 };
 
+// The last finished frame of gb, for hosts that draw on their own schedule.
+export const getFrameImage = (gb: number): ImageData => {
+  return frameImage(inst!.getFrameBuffer(gb));
+};
+
+// Deletes gb along with the views of its frame buffers, whose addresses
+// would otherwise stay in frameImages. Use it instead of the raw export.
+export const deleteGameboy = (gb: number): void => {
+  const bufs = inst!.getFrameBuffers(gb);
+  if (bufs) {
+    frameImages.delete(bufs);
+    frameImages.delete(bufs + 160 * 144 * 4);
+  }
+  inst!.deleteGameboy(gb);
+};
+
 export const getMemoryGrowTimestamp = (): number => {
   return lastGrowTimestamp;
 };
@@ -1,13 +1,18 @@
 #include "io.h"
 
+#include "cow.h"
 #include "log.h"
+#include "timer.h"
 
 #include <cstring>
 
 #define N_BIT(x, n) (((x) >> (n)) & 1)
 
-IO::IO(Memory* mem, Video* video): mem_(mem), video_(video) {
+IO::IO(Memory* mem, Video* video, Timer* timer, const IO* parent): mem_(mem), video_(video), timer_(timer) {
   memset(reg_, 0, sizeof(reg_));
+  memset(oam, 0, sizeof(oam));
+  for (int i = 0; i < 0x20; ++i)
+    vramPage[i] = parent ? cowShare(parent->vramPage[i]) : cowAlloc(0x100);
   enableInterrupt();
   reg_[P1] = 0xF;
   reg_[LCDC] = 0x91;
@@ -15,9 +20,15 @@ IO::IO(Memory* mem, Video* video): mem_(mem), video_(video) {
   reg_[OBP0] = 0xFF;
   reg_[OBP1] = 0xFF;
   reg_[JOYPAD_DATA] = 0xFF;
+  timerRead = false;
+  events = 0;
+  oamGen = 0;
 }
 
-IO::~IO() {}
+IO::~IO() {
+  for (int i = 0; i < 0x20; ++i)
+    cowRelease(vramPage[i]);
+}
 
 void IO::disableInterrupt() {
   // ERR << "IO DL" << endl;
@@ -37,11 +48,14 @@ uint8_t IO::read(uint16_t addr) {
   switch (reg) {
     case IF:
       return reg_[IME] & reg_[IF];
+    case DIV:
+    case TIMA:
+      timerRead = true;
+      timer_->sync();
+      return reg_[reg];
     case P1:
     case SB:
     case SC:
-    case DIV:
-    case TIMA:
     case TMA:
     case TAC:
     case NR10:
@@ -103,14 +117,18 @@ uint8_t IO::write(uint16_t addr, uint8_t datum) {
     case STAT:
       ERR << "STAT write " << datum << endl;
       return reg_[reg] = (reg_[reg] & 0x7) | (datum & 0xF8);
-    case LCDC:
+    case LCDC: {
       ERR.pc() << "LCDC write " << datum << " STAT " << reg_[STAT] << endl;
+      bool wasOn = (reg_[LCDC] & 0x80) == 0x80;
       if ((datum & 0x80) != 0x80) {
         reg_[LY] = 0;
         reg_[STAT] = reg_[STAT] & 0xF8;
-        video_->resetTimer();
       }
-      return reg_[reg] = datum;
+      reg_[reg] = datum;
+      if ((datum & 0x80) != 0x80 || !wasOn)
+        video_->resetTimer();
+      return datum;
+    }
     case P1:
       return reg_[reg] = getP1Data(datum, reg_[JOYPAD_DATA]);
     case LY:
@@ -119,13 +137,21 @@ uint8_t IO::write(uint16_t addr, uint8_t datum) {
       video_->resetTimer();
       return 0;
     case DIV:
-      return reg_[reg] = 0;
+      timer_->sync();
+      timer_->resetDiv();
+      return 0;
+    case TIMA:
+    case TAC:
+      timer_->sync();
+      reg_[reg] = datum;
+      timer_->reschedule();
+      return datum;
+    case TMA:
+      timer_->sync();
+      return reg_[reg] = datum;
 
     case SB:
     case SC:
-    case TIMA:
-    case TMA:
-    case TAC:
     case IF:
     case NR10:
     case NR11:
@@ -186,10 +212,12 @@ uint8_t IO::doDMA_(uint8_t arg) {
   for (uint16_t i = 0; i < 0xA0; ++i) {
     oam[i] = mem_->read(base | i);
   }
+  ++oamGen;
   return 0;
 }
 
 void IO::setJoypad(uint8_t datum) {
+  ++events;
   uint8_t& old = reg_[JOYPAD_DATA];
   if ((old & datum) != old) {
     // if High to Low
@@ -199,3 +227,22 @@ void IO::setJoypad(uint8_t datum) {
   old = datum;
   reg_[P1] = getP1Data(reg_[P1], datum);
 }
+
+void IO::serialize(Snapshot* state) {
+  state->field(reg_);
+  state->field(oam);
+  if (state->bulk()) {
+    for (int i = 0; i < 0x20; ++i) {
+      if (state->loading())
+        vramPage[i] = cowOwn(vramPage[i]);
+      state->bytes(vramPage[i], 0x100);
+    }
+    if (state->loading())
+      mem_->remapRam();
+  }
+  if (state->loading()) {
+    timerRead = true;
+    ++events;
+    ++oamGen;
+  }
+}
@@ -1,3 +1,3 @@
 #include "log.h"
 
-JSStream ERR;
\ No newline at end of file
+thread_local JSStream ERR;
\ No newline at end of file
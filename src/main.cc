@@ -1,32 +1,179 @@
+#include "batch.h"
 #include "gameboy.h"
 
-#include "log.h"
+#include "rom.h"
 
+#ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#endif
 
 // #include <fstream>
 #include <cstdio>
 // #include <iostream>
 
+// Natively these are plain C functions, for hosts that embed the core.
+#ifdef __EMSCRIPTEN__
 #define EXPORT EMSCRIPTEN_KEEPALIVE
+#else
+#define EXPORT
+#endif
 
 extern "C" {
-EXPORT Gameboy* createGameboy(uint8_t* romData, int canvasId) {
-  return new Gameboy(romData, canvasId);
+// Takes ownership of the size bytes at romData, a malloc'd ROM image.
+EXPORT Gameboy* createGameboy(uint8_t* romData, int size, int canvasId) {
+  return new Gameboy(romData, size < 0 ? 0 : size, canvasId);
+}
+
+// A copy of gb sharing its ROM and, until written, its memory; see
+// Gameboy::fork(). Either may be deleted first.
+EXPORT Gameboy* forkGameboy(Gameboy* gb) {
+  return gb->fork();
+}
+
+EXPORT void deleteGameboy(Gameboy* gb) {
+  delete gb;
+}
+
+// Distinct ROM images held by all instances; see Rom::acquire().
+EXPORT int getRegisteredRoms() {
+  return Rom::registered();
 }
 
 EXPORT void executeSingleFrame(Gameboy* gb, uint8_t joypad) {
   gb->executeSingleFrame(joypad);
 }
 
-EXPORT void dump() {
-  ERR.mem(0xFF80).mem(0xFF81).mem(0xFFE1) << endl;
-  // ERR.mem(0xFF00) << endl;
-  // ERR << "oam:" << endl;
-  // for (uint16_t i = 0; i < 0xA0; i += 4) {
-  //   ERR.mem(i).mem(i+1).mem(i+2).mem(i+3) << endl;
+// Runs up to n frames in one call; see Gameboy::executeFrames() for flags and
+// the record layout. Returns the number of frames run.
+EXPORT int executeFrames(Gameboy* gb, int n, const uint8_t* inputs, int flags, uint8_t* out, int size) {
+  return gb->executeFrames(n, inputs, flags, out, size);
+}
+
+EXPORT int getFrameRecordSize(int flags) {
+  return Gameboy::frameRecordSize(flags);
+}
+
+EXPORT void runAhead(Gameboy* gb, uint8_t joypad, int frames) {
+  gb->runAhead(joypad, frames);
+}
+
+EXPORT double getCycles(Gameboy* gb) {
+  return gb->cycles();
+}
+
+EXPORT double getIdleCycles(Gameboy* gb) {
+  return gb->idleCycles();
+}
+
+EXPORT int isSaveDirty(Gameboy* gb) {
+  return gb->saveDirty();
+}
+
+EXPORT uint8_t* getSaveRam(Gameboy* gb) {
+  return gb->saveRam();
+}
+
+EXPORT int getSaveRamSize(Gameboy* gb) {
+  return gb->saveRamSize();
+}
+
+// Marks battery RAM clean and returns the number of changed ranges, stored
+// as (offset, length) pairs at getSaveRanges().
+EXPORT int takeSaveRanges(Gameboy* gb) {
+  return gb->takeSaveRanges().size() / 2;
+}
+
+EXPORT const uint32_t* getSaveRanges(Gameboy* gb) {
+  return gb->saveRanges().data();
+}
+
+EXPORT int getStateSize(Gameboy* gb) {
+  return gb->stateSize();
+}
+
+EXPORT int saveState(Gameboy* gb, uint8_t* buf, int size) {
+  return gb->saveState(buf, size);
+}
+
+EXPORT int loadState(Gameboy* gb, const uint8_t* buf, int size) {
+  return gb->loadState(buf, size);
+}
+
+EXPORT void setRewind(Gameboy* gb, int frames, int budget) {
+  gb->setRewind(frames, budget);
+}
+
+EXPORT int rewindFrames(Gameboy* gb, int frames) {
+  return gb->rewind(frames);
+}
+
+EXPORT void setBackgroundCache(Gameboy* gb, int on) {
+  gb->setBackgroundCache(on);
+}
+
+// The last finished frame as 160x144 RGBA pixels (see setColors). Stays valid
+// and unchanged until the next frame is finished.
+EXPORT const uint32_t* getFrameBuffer(Gameboy* gb) {
+  return gb->frame();
+}
+
+// Both buffers getFrameBuffer() alternates between, back to back, or 0.
+EXPORT const uint32_t* getFrameBuffers(Gameboy* gb) {
+  return gb->frameBuffers();
+}
+
+EXPORT void setColors(Gameboy* gb, uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3) {
+  uint32_t colors[4] = {c0, c1, c2, c3};
+  gb->setColors(colors);
+}
+
+// maxSkip 0 turns frame skip off; see Gameboy::setFrameSkip().
+EXPORT void setFrameSkip(Gameboy* gb, int maxSkip, double budgetMs) {
+  gb->setFrameSkip(maxSkip, budgetMs);
+}
+
+// Pictures currently skipped after each drawn one.
+EXPORT int getFrameSkip(Gameboy* gb) {
+  return gb->frameSkip();
+}
+
+EXPORT void setHeadless(Gameboy* gb, int headless, int hash, int every) {
+  gb->setHeadless(headless, hash, every);
+}
+
+// Hash of the last hashed picture, as two 32-bit words, low word first.
+EXPORT const uint64_t* getFrameHash(Gameboy* gb) {
+  return &gb->frameHash();
+}
+
+// Takes ownership of romData like createGameboy.
+EXPORT GameboyBatch* createBatch(uint8_t* romData, int size, int count) {
+  return new GameboyBatch(romData, size < 0 ? 0 : size, count);
+}
+
+EXPORT void deleteBatch(GameboyBatch* batch) {
+  delete batch;
+}
+
+EXPORT void setBatchObservation(GameboyBatch* batch, const uint16_t* addrs, int n, int flags) {
+  batch->setObservation(addrs, n, flags);
+}
+
+EXPORT int getBatchObservationSize(GameboyBatch* batch) {
+  return batch->observationSize();
+}
+
+EXPORT void setBatchDone(GameboyBatch* batch, int addr, int mask, int value) {
+  batch->setDone(addr, mask, value);
+}
+
+// One joypad byte per machine in actions; observations go to out.
+EXPORT void stepBatch(GameboyBatch* batch, const uint8_t* actions, int frames, uint8_t* out) {
+  batch->step(actions, frames, out);
+}
 
-  // }
+EXPORT void resetBatch(GameboyBatch* batch, int i) {
+  batch->reset(i);
 }
 }
 
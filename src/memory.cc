@@ -1,88 +1,253 @@
 #include "memory.h"
+#include "arena.h"
+#include "cow.h"
 #include "log.h"
 
-Memory::Memory(Cartridge&& cart, IO* io) : cart_(std::move(cart)), io_(io) {
-  ram_ = new uint8_t[0x2000];
-  highRam_ = new uint8_t[0x7F];
+#include <cstring>
+
+const uint32_t FIXED_BANK = 0;
+
+Memory::Memory(Cartridge&& cart, IO* io, Memory* parent) : cart_(std::move(cart)), io_(io), shadow_(nullptr) {
+  // Zeroed rather than left random so that runs replay exactly.
+  for (int i = 0; i < 0x20; ++i)
+    ramPages_[i] = parent ? cowShare(parent->ramPages_[i]) : cowAlloc(0x100);
+  highRam_ = static_cast<uint8_t*>(arenaAlloc(0x7F));
+  if (parent)
+    memcpy(highRam_, parent->highRam_, 0x7F);
+  else
+    memset(highRam_, 0, 0x7F);
+  memset(writeGen_, 0, sizeof(writeGen_));
+  memset(readPage_, 0, sizeof(readPage_));
+  memset(writePage_, 0, sizeof(writePage_));
+  mapPages_(0x0000, 0x4000, cart_.romData(0x0000), nullptr);
+  mapCart_(Cartridge::REMAP_ROM | Cartridge::REMAP_RAM);
+  remapRam();
+  if (parent) {
+    // Every VRAM and WRAM page is shared now: writes on either side go
+    // through writeSlow_() until the page is copied.
+    parent->mapCart_(Cartridge::REMAP_RAM);
+    memset(parent->writePage_ + 0x80, 0, 0x20 * sizeof(uint8_t*));
+    memset(parent->writePage_ + 0xC0, 0, 0x20 * sizeof(uint8_t*));
+  }
 }
 
 Memory::~Memory() {
-  delete ram_;
-  delete highRam_;
+  for (int i = 0; i < 0x20; ++i)
+    cowRelease(ramPages_[i]);
+  arenaFree(highRam_);
+  arenaFree(shadow_);
 }
 
-uint8_t Memory::read(uint16_t addr) {
-  if (addr < 0x8000)
-    return cart_.rom(addr);
-  if (addr < 0xA000)
-    return io_->vram[addr - 0x8000];
-  if (addr < 0xC000)
-    return cart_.ram(addr - 0xA000);
-  if (addr < 0xE000)
-    return ram_[addr - 0xC000];
-  if (addr < 0xFE00)
-    return ram_[addr - 0xE000];
-  if (addr < 0xFEA0)
-    return io_->oam[addr - 0xFE00];
-  if (addr < 0xFF00) {
-    ERR << "Read UIO Addr " << addr << endl;
-    return 0;
+// read and write are the host memory behind begin, either may be nullptr.
+void Memory::mapPages_(uint16_t begin, uint16_t end, const uint8_t* read, uint8_t* write) {
+  for (int page = begin >> 8; page < end >> 8; ++page) {
+    int offset = (page << 8) - begin;
+    readPage_[page] = read ? read + offset : nullptr;
+    writePage_[page] = write ? write + offset : nullptr;
   }
-  if (addr < 0xFF4C)
-    return io_->read(addr);
-  if (addr < 0xFF80) {
-    ERR << "Read UIO Addr " << addr << endl;
-    return 0;
+}
+
+// Cartridge registers are written through the slow path, so ROM pages are
+// never writable. A bank switch only repoints the pages of the window that
+// changed, see Cartridge::write().
+void Memory::mapCart_(uint8_t remap) {
+  if (remap & Cartridge::REMAP_ROM)
+    mapPages_(0x4000, 0x8000, cart_.romData(0x4000), nullptr);
+  if (remap & Cartridge::REMAP_RAM) {
+    uint8_t* ram = cart_.ramData();
+    mapPages_(0xA000, 0xC000, ram, ram);
+    for (int page = 0xA0; ram && page < 0xC0; ++page) {
+      if (!cart_.ramPageWritable(page << 8 & 0x1FFF))
+        writePage_[page] = nullptr;
+    }
   }
-  if (addr < 0xFFFF) {
-    // if (addr == 0xFF85) return 1;
-    // if (addr == 0xFF80) return 0;
+}
+
+uint8_t Memory::readSlow_(uint16_t addr) {
+  if (addr >= 0xFF80 && addr < 0xFFFF)
     return highRam_[addr - 0xFF80];
-  }
-  if (addr == 0xFFFF)
-    return io_->read(0xFFFF);
-  ERR << "Read address out of bound: " << addr << endl;
+  if (addr < 0xC000)
+    return cart_.readRam(addr - 0xA000);
+  if (addr >= 0xFE00 && addr < 0xFEA0)
+    return io_->oam[addr - 0xFE00];
+  if ((addr >= 0xFF00 && addr < 0xFF4C) || addr == 0xFFFF)
+    return io_->read(addr);
+  ERR << "Read UIO Addr " << addr << endl;
   return 0;
 }
 
 uint16_t Memory::read16(uint16_t addr) {
+  const uint8_t* page = readPage_[addr >> 8];
+  if (page && (addr & 0xFF) != 0xFF)
+    return page[addr & 0xFF] | static_cast<uint16_t>(page[(addr & 0xFF) + 1]) << 8;
   return read(addr) | static_cast<uint16_t>(read(addr + 1)) << 8;
 }
 
-uint8_t Memory::write(uint16_t addr, uint8_t datum) {
-  if (addr < 0x8000)
-    return cart_.write(addr, datum);
-  if (addr < 0xA000)
-    return io_->vram[addr - 0x8000] = datum;
-  if (addr < 0xC000)
-    return cart_.ram(addr - 0xA000) = datum;
-  if (addr < 0xE000)
-    return ram_[addr - 0xC000] = datum;
-  if (addr < 0xFE00)
-    return ram_[addr - 0xE000] = datum;
-  if (addr < 0xFEA0)
+uint8_t Memory::writeSlow_(uint16_t addr, uint8_t datum) {
+  if (addr >= 0xFF80 && addr < 0xFFFF) {
+    ++writeGen_[0xFF];
+    return highRam_[addr - 0xFF80] = datum;
+  }
+  if (addr < 0x8000) {
+    mapCart_(cart_.write(addr, datum));
+    return datum;
+  }
+  // VRAM and WRAM pages get here only while they are shared with a fork.
+  if (addr < 0xA000 || (addr >= 0xC000 && addr < 0xE000)) {
+    ++writeGen_[addr >> 8];
+    return ownPage_(addr >> 8)[addr & 0xFF] = datum;
+  }
+  if (addr < 0xC000) {
+    const uint8_t* ram = cart_.ramData();
+    cart_.writeRam(addr - 0xA000, datum);
+    ++writeGen_[addr >> 8];
+    // The first write after a fork moves RAM to a private copy.
+    if (cart_.ramData() != ram)
+      mapCart_(Cartridge::REMAP_RAM);
+    // The page is dirty now: let further writes take the fast path.
+    if (readPage_[addr >> 8])
+      writePage_[addr >> 8] = cart_.ramData() + (addr & 0x1F00);
+    return datum;
+  }
+  if (addr < 0xFE00) {
+    ++writeGen_[(addr - 0x2000) >> 8];
+    return ownPage_((addr - 0x2000) >> 8)[addr & 0xFF] = datum;
+  }
+  if (addr < 0xFEA0) {
+    ++io_->oamGen;
     return io_->oam[addr - 0xFE00] = datum;
+  }
   if (addr < 0xFF00) {
     // ERR << "Wirte UIO Addr " << addr << " " << datum << endl;
     return 0;
   }
-  if (addr < 0xFF4C)
+  if (addr < 0xFF4C || addr == 0xFFFF)
     return io_->write(addr, datum);
-  if (addr < 0xFF80) {
-    // ERR << "Write UIO Addr " << addr << " " << datum << endl;
-    return 0;
-  }
-  if (addr < 0xFFFF) {
-    return highRam_[addr - 0xFF80] = datum;
-  }
-  if (addr == 0xFFFF)
-    return io_->write(0xFFFF, datum);
-  ERR << "Write address out of bound: " << addr << endl;
+  // ERR << "Write UIO Addr " << addr << " " << datum << endl;
   return 0;
 }
 
+const uint32_t& Memory::codeTag(uint16_t addr) {
+  if (addr < 0x4000)
+    return FIXED_BANK;
+  if (addr < 0x8000)
+    return cart_.romBank();
+  return writeGen_[addr >> 8];
+}
+
 uint16_t Memory::write16(uint16_t addr, uint16_t datum) {
+  uint8_t* page = writePage_[addr >> 8];
+  if (page && (addr & 0xFF) != 0xFF) {
+    writeGen_[addr >> 8] += 2;
+    page[addr & 0xFF] = datum & 0xFF;
+    page[(addr & 0xFF) + 1] = datum >> 8;
+    return datum;
+  }
   write(addr, datum & 0xFF);
   write(addr + 1, (datum >> 8) & 0xFF);
   return datum;
-}
\ No newline at end of file
+}
+
+void Memory::serialize(Snapshot* state) {
+  cart_.serialize(state);
+  for (int i = 0; state->bulk() && i < 0x20; ++i) {
+    if (state->loading())
+      ramPages_[i] = cowOwn(ramPages_[i]);
+    state->bytes(ramPages_[i], 0x100);
+  }
+  state->bytes(highRam_, 0x7F);
+  if (state->loading()) {
+    mapCart_(Cartridge::REMAP_ROM | Cartridge::REMAP_RAM);
+    remapRam();
+    // Code decoded from RAM must not survive a load. Without the bulk
+    // memory only HRAM was loaded; restore() handles the rest.
+    if (state->bulk()) {
+      for (int page = 0; page < 0x100; ++page)
+        ++writeGen_[page];
+    } else {
+      ++writeGen_[0xFF];
+    }
+  }
+}
+
+// VRAM and WRAM pages, and where checkpoint() keeps them.
+uint8_t* Memory::hostPage_(int page) {
+  return page < 0xA0 ? io_->vramPage[page - 0x80] : ramPages_[page - 0xC0];
+}
+
+// A VRAM or WRAM page is written directly unless it is shared with a fork.
+// Echo RAM writes stay on the slow path so that they bump the generation
+// of the mirrored WRAM page.
+void Memory::mapRamPage_(int page) {
+  uint8_t* host = hostPage_(page);
+  readPage_[page] = host;
+  writePage_[page] = cowShared(host) ? nullptr : host;
+  if (page >= 0xC0 && page < 0xDE)
+    readPage_[page + 0x20] = host;
+}
+
+void Memory::remapRam() {
+  for (int page = 0x80; page < 0xA0; ++page)
+    mapRamPage_(page);
+  for (int page = 0xC0; page < 0xE0; ++page)
+    mapRamPage_(page);
+}
+
+// Takes a private copy of a shared VRAM or WRAM page.
+uint8_t* Memory::ownPage_(int page) {
+  uint8_t*& host = page < 0xA0 ? io_->vramPage[page - 0x80] : ramPages_[page - 0xC0];
+  host = cowOwn(host);
+  mapRamPage_(page);
+  return host;
+}
+
+void Memory::copyWorkRam(uint8_t* out) const {
+  for (int i = 0; i < 0x20; ++i)
+    memcpy(out + i * 0x100, ramPages_[i], 0x100);
+}
+
+uint8_t* Memory::shadowPage_(int page) {
+  return shadow_ + (page < 0xA0 ? page - 0x80 : page - 0xA0) * 0x100;
+}
+
+void Memory::checkpoint() {
+  size_t cartRam = cart_.saveRamSize();
+  if (shadow_ == nullptr) {
+    shadow_ = static_cast<uint8_t*>(arenaAlloc(0x4000 + cartRam));
+    for (int page = 0; page < 0x100; ++page)
+      shadowGen_[page] = writeGen_[page] - 1;
+  }
+  bool cartDirty = false;
+  for (int page = 0x80; page < 0xE0; ++page) {
+    if (shadowGen_[page] == writeGen_[page])
+      continue;
+    shadowGen_[page] = writeGen_[page];
+    if (page < 0xA0 || page >= 0xC0)
+      memcpy(shadowPage_(page), hostPage_(page), 0x100);
+    else
+      cartDirty = true;
+  }
+  // Cartridge RAM pages are banked, so any write copies all of it.
+  if (cartDirty && cartRam != 0)
+    memcpy(shadow_ + 0x4000, cart_.saveRam(), cartRam);
+}
+
+void Memory::restore() {
+  bool cartDirty = false;
+  for (int page = 0x80; page < 0xE0; ++page) {
+    if (shadowGen_[page] == writeGen_[page])
+      continue;
+    // A new generation: the contents change back, so code decoded from the
+    // page in between is stale.
+    shadowGen_[page] = ++writeGen_[page];
+    if (page < 0xA0 || page >= 0xC0)
+      memcpy(ownPage_(page), shadowPage_(page), 0x100);
+    else
+      cartDirty = true;
+  }
+  if (cartDirty && cart_.saveRamSize() != 0) {
+    cart_.ownRam();
+    memcpy(cart_.saveRam(), shadow_ + 0x4000, cart_.saveRamSize());
+    mapCart_(Cartridge::REMAP_RAM);
+  }
+}
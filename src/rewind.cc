@@ -0,0 +1,150 @@
+#include "rewind.h"
+
+#include <cstring>
+#include <utility>
+
+namespace {
+
+size_t putVarint(uint8_t* out, size_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = value | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+size_t getVarint(const uint8_t* in, size_t* value) {
+  size_t n = 0;
+  *value = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = in[n++];
+    *value |= static_cast<size_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return n;
+  }
+}
+
+uint64_t load64(const uint8_t* p) {
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+// Encodes a ^ b as (zero run, literal length, literal bytes) tokens. Runs
+// are found 8 bytes at a time, a literal ends at the first unchanged 8-byte
+// word, and literals are then trimmed to the changed bytes. Every token but
+// the last covers at least 9 bytes, so the output never exceeds 1.7 * n + 16
+// bytes.
+size_t encodeDelta(const uint8_t* a, const uint8_t* b, size_t n, uint8_t* out) {
+  size_t i = 0;
+  size_t o = 0;
+  while (i < n) {
+    size_t zeros = i;
+    while (i + 8 <= n && load64(a + i) == load64(b + i))
+      i += 8;
+    while (i < n && a[i] == b[i])
+      ++i;
+    if (i == n)
+      break;
+    size_t literal = i;
+    while (i + 8 <= n && load64(a + i) != load64(b + i))
+      i += 8;
+    if (i + 8 > n)
+      i = n;
+    while (a[i - 1] == b[i - 1])
+      --i;
+    o += putVarint(out + o, literal - zeros);
+    o += putVarint(out + o, i - literal);
+    for (size_t j = literal; j < i; ++j)
+      out[o++] = a[j] ^ b[j];
+  }
+  return o;
+}
+
+void applyDelta(const uint8_t* in, size_t size, uint8_t* state) {
+  size_t i = 0;
+  size_t p = 0;
+  while (p < size) {
+    size_t zeros, literal;
+    p += getVarint(in + p, &zeros);
+    p += getVarint(in + p, &literal);
+    i += zeros;
+    for (size_t j = 0; j < literal; ++j)
+      state[i++] ^= in[p++];
+  }
+}
+
+}  // namespace
+
+Rewind::Rewind(size_t stateSize, int frames, size_t budget)
+    : stateSize_(stateSize), hasLast_(false), budget_(budget), head_(0),
+      maxEntries_(frames), first_(0), count_(0) {
+  last_ = new uint8_t[stateSize_];
+  next_ = new uint8_t[stateSize_];
+  delta_ = new uint8_t[stateSize_ * 17 / 10 + 16];
+  ring_ = new uint8_t[budget_];
+  entries_ = new Entry[maxEntries_];
+}
+
+Rewind::~Rewind() {
+  delete[] last_;
+  delete[] next_;
+  delete[] delta_;
+  delete[] ring_;
+  delete[] entries_;
+}
+
+void Rewind::drop_() {
+  first_ = (first_ + 1) % maxEntries_;
+  --count_;
+}
+
+void Rewind::push() {
+  if (hasLast_) {
+    size_t size = encodeDelta(last_, next_, stateSize_, delta_);
+    if (size > budget_) {
+      // Too big to keep: the history before this state is lost.
+      count_ = 0;
+      head_ = 0;
+    } else {
+      // Live deltas are laid out oldest first from head_ to the end of the
+      // ring and then from its start, so making room only ever drops the
+      // oldest ones.
+      if (head_ + size > budget_) {
+        while (count_ > 0 && entries_[first_].offset >= head_)
+          drop_();
+        head_ = 0;
+      }
+      while (count_ > 0 && entries_[first_].offset >= head_ && entries_[first_].offset < head_ + size)
+        drop_();
+      if (count_ == maxEntries_)
+        drop_();
+      memcpy(ring_ + head_, delta_, size);
+      entries_[(first_ + count_) % maxEntries_] = {static_cast<uint32_t>(head_), static_cast<uint32_t>(size)};
+      ++count_;
+      head_ += size;
+    }
+  }
+  std::swap(last_, next_);
+  hasLast_ = true;
+}
+
+int Rewind::rewind(int frames) {
+  int n = 0;
+  for (; n < frames && count_ > 0; ++n) {
+    const Entry& entry = entries_[(first_ + count_ - 1) % maxEntries_];
+    applyDelta(ring_ + entry.offset, entry.size, last_);
+    head_ = entry.offset;
+    --count_;
+  }
+  return n;
+}
+
+size_t Rewind::bytes() const {
+  size_t total = 0;
+  for (int i = 0; i < count_; ++i)
+    total += entries_[(first_ + i) % maxEntries_].size;
+  return total;
+}
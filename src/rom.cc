@@ -0,0 +1,273 @@
+#include "rom.h"
+
+#include "log.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#ifndef __EMSCRIPTEN__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const uint32_t ROM_BANK_SIZE = 0x4000;
+
+// Every live image by content hash, mapped files by a hash of their
+// identity instead, and all by buffer so that handles on one buffer skip
+// hashing. BORROWED images are only found by buffer.
+struct Registry {
+  std::mutex lock;
+  std::unordered_multimap<uint64_t, Rom*> byHash;
+  std::unordered_multimap<uint64_t, Rom*> byFile;
+  std::unordered_map<const uint8_t*, Rom*> byData;
+  size_t count = 0;
+};
+
+Registry& registry() {
+  static Registry registry;
+  return registry;
+}
+
+// 8 bytes a step; matches are compared in full, so this need only spread.
+uint64_t hashImage(const uint8_t* data, size_t size) {
+  uint64_t h = 1469598103934665603ull ^ size;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h = (h ^ word) * 1099511628211ull;
+    h ^= h >> 29;
+  }
+  for (; i < size; ++i)
+    h = (h ^ data[i]) * 1099511628211ull;
+  return h;
+}
+
+void releaseImage(const uint8_t* data, size_t size, Rom::Ownership ownership) {
+  switch (ownership) {
+    case Rom::OWNED:
+      free(const_cast<uint8_t*>(data));
+      break;
+#ifndef __EMSCRIPTEN__
+    case Rom::MAPPED:
+      munmap(const_cast<uint8_t*>(data), size);
+      break;
+#endif
+    default:
+      break;
+  }
+}
+
+}  // namespace
+
+Rom::Rom(const uint8_t* data, size_t size, Ownership ownership)
+    : refs_(1), data_(data), size_(size), ownership_(ownership), hash_(0), file_() {
+  // Two banks at least, which also covers the header read below.
+  if (size_ < 2 * ROM_BANK_SIZE) {
+    ERR << "ROM too small: " << static_cast<int32_t>(size_) << endl;
+    throw 1;
+  }
+  switch (data_[0x147]) {
+    case 0x00:
+    case 0x08:
+    case 0x09:
+      mbc_ = MBC_NONE;
+      break;
+    case 0x01:
+    case 0x02:
+    case 0x03:
+      mbc_ = MBC_1;
+      break;
+    case 0x0F:
+    case 0x10:
+    case 0x11:
+    case 0x12:
+    case 0x13:
+      mbc_ = MBC_3;
+      break;
+    case 0x19:
+    case 0x1A:
+    case 0x1B:
+    case 0x1C:
+    case 0x1D:
+    case 0x1E:
+      mbc_ = MBC_5;
+      break;
+    default:
+      ERR << "Cartridge type not supported: " << data_[0x147] << endl;
+      throw 1;
+  }
+  romBanks_ = data_[0x148] <= 8 ? 2 << data_[0x148] : 2;
+  if (size_ < romBanks_ * ROM_BANK_SIZE) {
+    ERR << "ROM smaller than its header says: " << static_cast<int32_t>(size_) << endl;
+    throw 1;
+  }
+  static const uint32_t RAM_BANKS[] = {0, 1, 1, 4, 16, 8};
+  ramBanks_ = data_[0x149] < 6 ? RAM_BANKS[data_[0x149]] : 0;
+  switch (data_[0x147]) {
+    case 0x03:
+    case 0x09:
+    case 0x0F:
+    case 0x10:
+    case 0x13:
+    case 0x1B:
+    case 0x1E:
+      battery_ = ramBanks_ != 0;
+      break;
+    default:
+      battery_ = false;
+  }
+  for (uint32_t reg = 0; reg < 0x200; ++reg)
+    banks_[reg] = data_ + (reg & (romBanks_ - 1)) * ROM_BANK_SIZE;
+}
+
+Rom::~Rom() {
+  if (data_ != nullptr)
+    releaseImage(data_, size_, ownership_);
+}
+
+Rom* Rom::acquire(const uint8_t* data, size_t size, Ownership ownership) {
+  Registry& registry = ::registry();
+  // Called with the lock held: a handle on the registration of this very
+  // buffer, if any. One so far only borrowed passes to the new owner, who
+  // would otherwise never see the buffer released.
+  auto sameBuffer = [&]() -> Rom* {
+    auto it = registry.byData.find(data);
+    if (it == registry.byData.end() || it->second->size_ != size)
+      return nullptr;
+    Rom* rom = it->second;
+    if (rom->ownership_ == BORROWED && ownership != BORROWED) {
+      rom->ownership_ = ownership;
+      registry.byHash.emplace(rom->hash_, rom);
+    }
+    return rom->share();
+  };
+  {
+    std::lock_guard<std::mutex> guard(registry.lock);
+    if (Rom* rom = sameBuffer())
+      return rom;
+  }
+  // Parsed and hashed outside the lock; a duplicate is dropped below.
+  Rom* rom = new Rom(data, size, ownership);
+  rom->hash_ = hashImage(rom->data_, rom->size_);
+  std::lock_guard<std::mutex> guard(registry.lock);
+  // Another thread may have registered this very buffer meanwhile.
+  if (Rom* other = sameBuffer()) {
+    rom->data_ = nullptr;
+    delete rom;
+    return other;
+  }
+  auto range = registry.byHash.equal_range(rom->hash_);
+  for (auto it = range.first; it != range.second; ++it) {
+    Rom* other = it->second;
+    if (other->size_ != rom->size_ || memcmp(other->data_, rom->data_, rom->size_) != 0)
+      continue;
+    rom->data_ = nullptr;
+    delete rom;
+    releaseImage(data, size, ownership);
+    return other->share();
+  }
+  if (ownership != BORROWED)
+    registry.byHash.emplace(rom->hash_, rom);
+  registry.byData.emplace(rom->data_, rom);
+  ++registry.count;
+  return rom;
+}
+
+#ifndef __EMSCRIPTEN__
+Rom* Rom::mapFile(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    ERR << "Cannot open ROM: " << path << endl;
+    throw 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    ERR << "Cannot map ROM: " << path << endl;
+    throw 1;
+  }
+  size_t size = st.st_size;
+  uint64_t file[3] = {static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+                      static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec};
+  uint64_t key = hashImage(reinterpret_cast<const uint8_t*>(file), sizeof(file)) ^ size;
+  Registry& registry = ::registry();
+  // Called with the lock held.
+  auto find = [&]() -> Rom* {
+    auto range = registry.byFile.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+      Rom* other = it->second;
+      if (other->size_ == size && memcmp(other->file_, file, sizeof(file)) == 0)
+        return other->share();
+    }
+    return nullptr;
+  };
+  {
+    std::lock_guard<std::mutex> guard(registry.lock);
+    if (Rom* rom = find()) {
+      close(fd);
+      return rom;
+    }
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    ERR << "Cannot map ROM: " << path << endl;
+    throw 1;
+  }
+  Rom* rom;
+  try {
+    rom = new Rom(static_cast<const uint8_t*>(data), size, MAPPED);
+  } catch (...) {
+    munmap(data, size);
+    throw;
+  }
+  rom->hash_ = key;
+  memcpy(rom->file_, file, sizeof(file));
+  std::lock_guard<std::mutex> guard(registry.lock);
+  // Another thread may have mapped the file meanwhile.
+  if (Rom* other = find()) {
+    delete rom;
+    return other;
+  }
+  registry.byFile.emplace(key, rom);
+  registry.byData.emplace(rom->data_, rom);
+  ++registry.count;
+  return rom;
+}
+#endif
+
+size_t Rom::registered() {
+  Registry& registry = ::registry();
+  std::lock_guard<std::mutex> guard(registry.lock);
+  return registry.count;
+}
+
+void Rom::release() {
+  Registry& registry = ::registry();
+  {
+    std::lock_guard<std::mutex> guard(registry.lock);
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+      return;
+    --registry.count;
+    auto it = registry.byData.find(data_);
+    if (it != registry.byData.end() && it->second == this)
+      registry.byData.erase(it);
+    for (auto* map : {&registry.byHash, &registry.byFile}) {
+      auto range = map->equal_range(hash_);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == this) {
+          map->erase(it);
+          break;
+        }
+      }
+    }
+  }
+  delete this;
+}
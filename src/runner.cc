@@ -0,0 +1,151 @@
+#ifndef __EMSCRIPTEN__
+#include "runner.h"
+
+#include "arena.h"
+#include "cartridge.h"
+#include "gameboy.h"
+#include "log.h"
+#include "rom.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace {
+
+const size_t CACHE_LINE = 64;
+// A headless machine takes some 400KB with its block cache, pages and
+// picture; frames, background maps and run-ahead shadows take it to about
+// 800KB. Anything beyond the arena comes from the heap.
+const size_t ARENA_SIZE = 2 << 20;
+
+// A worker's queue of episode indices and what it reuses from one episode
+// to the next. Workers are a cache line apart so that their queues and
+// counters are not shared.
+struct alignas(CACHE_LINE) Worker {
+  std::mutex lock;
+  std::deque<size_t> queue;
+  // The machine and all it allocates, reset after each episode, see
+  // arena.h. Only the ROM is shared with other workers.
+  Arena arena{ARENA_SIZE};
+  // The final save state, sized by the first episode.
+  std::vector<uint8_t> state;
+  uint64_t frames;
+};
+
+bool take(Worker* worker, size_t* episode) {
+  std::lock_guard<std::mutex> guard(worker->lock);
+  if (worker->queue.empty())
+    return false;
+  *episode = worker->queue.front();
+  worker->queue.pop_front();
+  return true;
+}
+
+bool steal(Worker* workers, int count, int self, size_t* episode) {
+  for (int i = 1; i < count; ++i) {
+    Worker* victim = &workers[(self + i) % count];
+    std::lock_guard<std::mutex> guard(victim->lock);
+    if (!victim->queue.empty()) {
+      *episode = victim->queue.back();
+      victim->queue.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t hashBytes(const uint8_t* data, size_t size) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < size; ++i)
+    h = (h ^ data[i]) * 1099511628211ull;
+  return h;
+}
+
+void runEpisode(Worker* worker, Runner::Episode* episode, Rom* rom) {
+  episode->frameHash = 0;
+  episode->stateHash = 0;
+  episode->failed = true;
+  static_assert(alignof(Gameboy) <= 16, "arenaAlloc() aligns to 16 bytes");
+  void* slot = nullptr;
+  Gameboy* gb = nullptr;
+  try {
+    slot = arenaAlloc(sizeof(Gameboy));
+    gb = new (slot) Gameboy(Cartridge(rom->share()), 0);
+    gb->setHeadless(true, false, 1);
+    // Only the last picture is hashed. It takes lines from at most the last
+    // three frames, so those are the only ones drawn.
+    int tail = std::min(episode->frames, 3);
+    uint64_t hashes[3];
+    gb->executeFrames(episode->frames - tail, episode->inputs, 0, nullptr, 0);
+    gb->executeFrames(tail, episode->inputs + episode->frames - tail, Gameboy::EXEC_HASH,
+                      reinterpret_cast<uint8_t*>(hashes), sizeof(hashes));
+    worker->state.resize(gb->stateSize());
+    gb->saveState(worker->state.data(), worker->state.size());
+    episode->frameHash = gb->frameHash();
+    episode->stateHash = hashBytes(worker->state.data(), worker->state.size());
+    episode->failed = false;
+    worker->frames += episode->frames;
+  } catch (...) {
+    // The core throws on what it cannot emulate, such as an unknown opcode;
+    // that ends this episode only.
+    ERR << "Episode failed" << endl;
+  }
+  if (gb != nullptr)
+    gb->~Gameboy();
+  arenaFree(slot);
+  worker->arena.reset();
+}
+
+}  // namespace
+
+Runner::Runner(int threads) : frames_(0), seconds_(0) {
+  threads_ = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+void Runner::run(std::vector<Episode>* episodes) {
+  // Images are registered up front, so that workers only take handles and
+  // episodes of one ROM share its bank table whichever worker runs them.
+  std::vector<Rom*> roms;
+  try {
+    for (const Episode& episode : *episodes)
+      roms.push_back(Rom::acquire(episode.rom, episode.romSize, Rom::BORROWED));
+  } catch (...) {
+    for (Rom* rom : roms)
+      rom->release();
+    throw;
+  }
+  Worker* workers = new Worker[threads_];
+  // Contiguous runs of episodes per worker; stealing evens out the rest.
+  for (size_t i = 0; i < episodes->size(); ++i)
+    workers[i * threads_ / episodes->size()].queue.push_back(i);
+  for (int t = 0; t < threads_; ++t)
+    workers[t].frames = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads_; ++t) {
+    pool.emplace_back([this, workers, episodes, &roms, t] {
+      ArenaScope scope(&workers[t].arena);
+      size_t i;
+      while (take(&workers[t], &i) || steal(workers, threads_, t, &i))
+        runEpisode(&workers[t], &(*episodes)[i], roms[i]);
+    });
+  }
+  for (std::thread& thread : pool)
+    thread.join();
+  seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  frames_ = 0;
+  for (int t = 0; t < threads_; ++t)
+    frames_ += workers[t].frames;
+  delete[] workers;
+  for (Rom* rom : roms)
+    rom->release();
+}
+#endif
@@ -0,0 +1,43 @@
+#include "scheduler.h"
+
+Scheduler::Scheduler() : now_(0), next_(NEVER) {
+  for (int i = 0; i < EVENT_COUNT; ++i)
+    deadline_[i] = NEVER;
+}
+
+void Scheduler::update_() {
+  next_ = NEVER;
+  for (int i = 0; i < EVENT_COUNT; ++i) {
+    if (deadline_[i] < next_)
+      next_ = deadline_[i];
+  }
+}
+
+void Scheduler::schedule(Event event, uint64_t at) {
+  deadline_[event] = at;
+  update_();
+}
+
+void Scheduler::serialize(Snapshot* state) {
+  state->field(now_);
+  state->field(deadline_);
+  if (state->loading())
+    update_();
+}
+
+bool Scheduler::pop(Event* event, uint64_t* at) {
+  if (next_ > now_)
+    return false;
+  // Ties go to the lower event, so the PPU runs before the timer as it did
+  // when both were ticked after every instruction.
+  for (int i = 0; i < EVENT_COUNT; ++i) {
+    if (deadline_[i] == next_) {
+      *event = static_cast<Event>(i);
+      *at = next_;
+      deadline_[i] = NEVER;
+      update_();
+      return true;
+    }
+  }
+  return false;
+}
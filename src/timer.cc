@@ -1,6 +1,7 @@
 #include "timer.h"
 
-Timer::Timer(IO* io): io_(io), divTiming_(0), timing_(0) {}
+Timer::Timer(IO* io, Scheduler* sched)
+    : io_(io), sched_(sched), divBase_(0), next_(0), running_(false) {}
 
 const int CYCLE_PER_SECOND = 4194304;
 const int DIV_TIMING = CYCLE_PER_SECOND / 16384;
@@ -11,26 +12,56 @@ const int TIMING[] = {
   CYCLE_PER_SECOND / 16384,
 };
 
-void Timer::runCycles(int cycles) {
-  divTiming_ -= cycles;
-  if (divTiming_ < 0) {
-    divTiming_ += DIV_TIMING;
-    io_->reg(IO::DIV) += 1;
+// DIV ticks as soon as the first cycle has run, then every DIV_TIMING.
+uint64_t divTicks(uint64_t now) {
+  return (now + DIV_TIMING - 1) / DIV_TIMING;
+}
+
+void Timer::sync() {
+  uint64_t now = sched_->now();
+  io_->reg(IO::DIV) = divTicks(now) - divBase_;
+  if (!running_ || next_ > now)
+    return;
+
+  int timing = TIMING[io_->reg(IO::TAC) & 0x3];
+  uint64_t ticks = (now - next_) / timing + 1;
+  next_ += ticks * timing;
+  uint32_t tima = io_->reg(IO::TIMA) + ticks;
+  while (tima > 0xFF) {
+    tima = tima - 0x100 + io_->reg(IO::TMA);
+    io_->requestInterrupt(IO::IRQ_TIMER);
   }
+  io_->reg(IO::TIMA) = tima;
+}
 
+void Timer::reschedule() {
   uint8_t tac = io_->reg(IO::TAC);
   if ((tac & 0x4) != 0x4) {
-    timing_ = 0;
+    running_ = false;
+    sched_->cancel(Scheduler::EVENT_TIMER);
     return;
   }
-  timing_ -= cycles;
-  if (timing_ > 0)
-    return;
+  if (!running_) {
+    running_ = true;
+    next_ = sched_->now();
+  }
+  sched_->schedule(Scheduler::EVENT_TIMER,
+                   next_ + (uint64_t)(0xFF - io_->reg(IO::TIMA)) * TIMING[tac & 0x3]);
+}
 
-  timing_ += TIMING[tac & 0x3];
-  uint8_t& tima = io_->reg(IO::TIMA);
-  if (++ tima != 0)
-    return;
-  tima = io_->reg(IO::TMA);
-  io_->requestInterrupt(IO::IRQ_TIMER);
-}
\ No newline at end of file
+void Timer::resetDiv() {
+  divBase_ = divTicks(sched_->now());
+  io_->reg(IO::DIV) = 0;
+}
+
+void Timer::onEvent() {
+  ++io_->events;
+  sync();
+  reschedule();
+}
+
+void Timer::serialize(Snapshot* state) {
+  state->field(divBase_);
+  state->field(next_);
+  state->field(running_);
+}
@@ -1,7 +1,11 @@
 #include "video.h"
 
+#include "arena.h"
 #include "canvas.h"
+#include "cow.h"
 #include "log.h"
+#include "memory.h"
+#include "pixels.h"
 
 #include <algorithm>
 #include <cstring>
@@ -11,61 +15,203 @@
 // const int CYCLES_PER_FRAME = 70224;
 const int MOD_CYCLES[] = { 204, 456, 80, 172 };
 
-Video::Video(IO* io, int canvasId)
-    : io_(io), canvasId_(canvasId), timing_(0) {
-  memset(buf_, 10, sizeof(buf_));
+// Room for two finished frames.
+static uint32_t (*allocFrames())[144 * 160] {
+  return static_cast<uint32_t(*)[144 * 160]>(arenaAlloc(2 * 144 * 160 * sizeof(uint32_t)));
+}
+
+// Gray with full alpha, as R, G, B, A bytes whatever the host byte order.
+static uint32_t grayPixel(uint8_t shade) {
+  uint8_t rgba[4] = {shade, shade, shade, 255};
+  uint32_t pixel;
+  memcpy(&pixel, rgba, sizeof(pixel));
+  return pixel;
+}
+
+Video::Video(IO* io, Memory* mem, Scheduler* sched, int canvasId, const Video* parent)
+    : io_(io), mem_(mem), sched_(sched), canvasId_(parent ? parent->canvasId_ : canvasId), bgMaps_(nullptr), render_(true), present_(true), shadow_(nullptr) {
+  memset(lineDirty_, 0, sizeof(lineDirty_));
+  front_ = 0;
+  for (int page = 0; page < TILES / 16; ++page)
+    tileGen_[page] = mem_->writeGen(0x8000 + page * 0x100) - 1;
+  if (parent) {
+    // The picture buffer is machine state; the finished frames only matter
+    // when they are shown or read.
+    buf_ = cowShare(parent->buf_);
+    frames_ = nullptr;
+    framesUsed_ = false;
+    if (parent->frames_ && (parent->output_ & (OUTPUT_CANVAS | OUTPUT_FRAME))) {
+      frames_ = allocFrames();
+      framesUsed_ = true;
+      memcpy(frames_[0], parent->frames_[parent->front_], sizeof(frames_[0]));
+    }
+    memcpy(pixel_, parent->pixel_, sizeof(pixel_));
+    skip_ = parent->skip_;
+    skipLeft_ = parent->skipLeft_;
+    skipping_ = parent->skipping_;
+    output_ = parent->output_;
+    frameHash_ = parent->frameHash_;
+  } else {
+    buf_ = cowAlloc(144 * 160);
+    memset(buf_, 10, 144 * 160);
+    frames_ = allocFrames();
+    memset(frames_, 0, sizeof(frames_[0]) * 2);
+    framesUsed_ = false;
+    for (int shade = 0; shade < 256; ++shade)
+      pixel_[shade] = grayPixel(shade);
+    skip_ = 0;
+    skipLeft_ = 0;
+    skipping_ = false;
+    output_ = OUTPUT_CANVAS;
+    frameHash_ = 0;
+  }
+  spriteGen_ = io_->oamGen - 1;
+  spriteSize_ = 0;
+  resetTimer();
+}
+
+Video::~Video() {
+  cowRelease(buf_);
+  arenaFree(frames_);
+  arenaFree(shadow_);
+  arenaFree(bgMaps_);
+}
+
+// Tile number of a map entry. With LCDC bit 4 clear, entries are signed
+// offsets from 0x9000: 0-127 select tiles 256-383 and 128-255 the tiles at
+// 0x8800 shared with the other mode.
+static inline uint16_t bgTile(uint8_t id, bool unsignedData) {
+  return (unsignedData || id >= 128) ? id : 256 + id;
+}
+
+const uint8_t* Video::tile_(int tid, bool flipped) {
+  int page = tid >> 4;
+  uint32_t gen = mem_->writeGen(0x8000 + page * 0x100);
+  if (tileGen_[page] != gen) {
+    tileGen_[page] = gen;
+    const uint8_t* data = io_->vramPage[page];
+    for (int t = page * 16; t < page * 16 + 16; ++t) {
+      for (int row = 0; row < 8; ++row) {
+        uint8_t l1 = data[(t & 15) * 16 + row * 2];
+        uint8_t l2 = data[(t & 15) * 16 + row * 2 + 1];
+        uint8_t* out = tiles_ + t * 64 + row * 8;
+        uint8_t* flippedOut = flippedTiles_ + t * 64 + row * 8;
+        for (int px = 0; px < 8; ++px) {
+          uint8_t c = ((l1 >> (7 - px)) & 1) | (((l2 >> (7 - px)) & 1) << 1);
+          out[px] = c;
+          flippedOut[7 - px] = c;
+        }
+      }
+    }
+  }
+  return (flipped ? flippedTiles_ : tiles_) + tid * 64;
 }
 
 void Video::renderBackgroundLine_(uint8_t LCDC, uint8_t LY) {
   // ERR << "Video !! BGL " << endl;
   uint16_t mapBase = (((LCDC & 0x8) == 0x8) ? 0x1C00 : 0x1800);
-  uint16_t dataBase = (((LCDC & 0x10) == 0x10) ? 0x0 : 0x1000);
+  bool unsignedData = N_BIT(LCDC, 4);
   uint8_t SCY = io_->reg(IO::SCY);
   uint8_t SCX = io_->reg(IO::SCX);
   uint8_t y = LY + SCY; // unsigned overflow
   uint16_t ty = y / 8;
   uint8_t py = y & 0x7;
-  for (uint8_t i = 0; i < 160; ++i) {
-    uint8_t x = i + SCX; // unsigned overflow
-    uint16_t tx = x / 8;
-    uint8_t px = 7 - (x & 0x7);
-    uint16_t tid = io_->vram[mapBase + ty * 32 + tx];
-    uint16_t laddr;
-    if (dataBase == 0) {
-      laddr = dataBase + tid * 16 + py * 2;
-    } else {
-      ERR << "VIDOE NO IMPL" << endl;
-      throw 1;
+  uint8_t* out = buf_ + LY * 160;
+  if (bgMaps_ != nullptr) {
+    int map = N_BIT(LCDC, 3);
+    syncBackgroundMap_(map, unsignedData);
+    BackgroundMap& bg = bgMaps_[map];
+    for (uint32_t cells = bg.dirty[ty]; cells != 0; cells &= cells - 1) {
+      int tx = __builtin_ctz(cells);
+      const uint8_t* tile = tile_(bg.tile[ty * 32 + tx], false);
+      for (int row = 0; row < 8; ++row)
+        memcpy(bg.pixels + (ty * 8 + row) * 256 + tx * 8, tile + row * 8, 8);
     }
-    uint8_t l1 = io_->vram[laddr];
-    uint8_t l2 = io_->vram[laddr + 1];
-    buf_[LY * 160 + i] = ((l1 >> px) & 1) | (((l2 >> px) & 1) << 1);
+    bg.dirty[ty] = 0;
+    const uint8_t* line = bg.pixels + y * 256;
+    int n = std::min(256 - SCX, 160);
+    memcpy(out, line + SCX, n);
+    memcpy(out + n, line, 160 - n);
+    return;
+  }
+  // Whole tile rows at a time; only the first and last are partial.
+  uint8_t x = SCX;
+  for (int i = 0; i < 160;) {
+    uint16_t tid = bgTile(io_->vram(mapBase + ty * 32 + x / 8), unsignedData);
+    int n = std::min(8 - (x & 0x7), 160 - i);
+    memcpy(out + i, tile_(tid, false) + py * 8 + (x & 0x7), n);
+    i += n;
+    x += n; // unsigned overflow
   }
 }
 
-void Video::renderSpriteLine_(uint8_t LCDC, uint8_t LY) {
-  const int spSize = 8 + (N_BIT(LCDC, 2) << 3);
-  int oids[11];
-  memset(oids, -1, sizeof(oids));
-  for (int i = 0; i < 40; ++i) {
-    oids[10] = i;
-    int y = (int)io_->oam[i * 4] - 16;
-    if (y + spSize <= LY || LY < y)
+void Video::syncBackgroundMap_(int map, bool unsignedData) {
+  BackgroundMap& bg = bgMaps_[map];
+  uint16_t mapBase = map ? 0x1C00 : 0x1800;
+  bool modeChanged = bg.unsignedData != unsignedData;
+  bg.unsignedData = unsignedData;
+  // Cells whose entry now names another tile.
+  for (int page = 0; page < 4; ++page) {
+    uint32_t gen = mem_->writeGen(0x8000 + mapBase + page * 0x100);
+    if (gen == bg.mapGen[page] && !modeChanged)
       continue;
-    for (int j = 9; j >= 0; --j) {
-      if (oids[j] != -1) {
-        uint8_t x1 = io_->oam[oids[j] * 4 + 1];
-        uint8_t x2 = io_->oam[oids[j + 1] * 4 + 1];
-        if (x1 <= x2)
-          break;
+    bg.mapGen[page] = gen;
+    for (int cell = page * 256; cell < page * 256 + 256; ++cell) {
+      uint16_t tid = bgTile(io_->vram(mapBase + cell), unsignedData);
+      if (tid != bg.tile[cell]) {
+        bg.tile[cell] = tid;
+        bg.dirty[cell / 32] |= 1u << (cell & 31);
       }
-      std::swap(oids[j], oids[j + 1]);
     }
   }
-  for (int i = 0; i < 10; ++i) {
-    int oid = oids[i];
-    if (oid == -1)
-      break;
+  // Cells showing a tile from a written page of tile data.
+  uint32_t changed = 0;
+  for (int page = 0; page < TILES / 16; ++page) {
+    uint32_t gen = mem_->writeGen(0x8000 + page * 0x100);
+    if (gen != bg.tileGen[page]) {
+      bg.tileGen[page] = gen;
+      changed |= 1u << page;
+    }
+  }
+  if (changed == 0)
+    return;
+  for (int cell = 0; cell < 32 * 32; ++cell) {
+    if (N_BIT(changed, bg.tile[cell] >> 4))
+      bg.dirty[cell / 32] |= 1u << (cell & 31);
+  }
+}
+
+void Video::bucketSprites_(int spSize) {
+  spriteGen_ = io_->oamGen;
+  spriteSize_ = spSize;
+  memset(lineSpriteCount_, 0, sizeof(lineSpriteCount_));
+  // Each line keeps the 10 sprites with the smallest X, the earlier one
+  // first on a tie.
+  for (int i = 0; i < 40; ++i) {
+    int y = (int)io_->oam[i * 4] - 16;
+    uint8_t x = io_->oam[i * 4 + 1];
+    for (int line = std::max(0, y); line < std::min(144, y + spSize); ++line) {
+      uint8_t* sprites = lineSprites_[line];
+      uint8_t& count = lineSpriteCount_[line];
+      int pos = count;
+      while (pos > 0 && io_->oam[sprites[pos - 1] * 4 + 1] > x)
+        --pos;
+      if (pos == 10)
+        continue;
+      if (count < 10)
+        ++count;
+      memmove(sprites + pos + 1, sprites + pos, count - 1 - pos);
+      sprites[pos] = i;
+    }
+  }
+}
+
+void Video::renderSpriteLine_(uint8_t LCDC, uint8_t LY) {
+  const int spSize = 8 + (N_BIT(LCDC, 2) << 3);
+  if (spriteGen_ != io_->oamGen || spriteSize_ != spSize)
+    bucketSprites_(spSize);
+  for (int i = 0; i < lineSpriteCount_[LY]; ++i) {
+    int oid = lineSprites_[LY][i];
     uint8_t attr = io_->oam[oid * 4 + 3];
     int y = (int)io_->oam[oid * 4] - 16;
     int lid = LY - y;
@@ -73,22 +219,17 @@ void Video::renderSpriteLine_(uint8_t LCDC, uint8_t LY) {
       lid = spSize - lid - 1;
     }
     int x = (int)io_->oam[oid * 4 + 1] - 8;
-    int tid = io_->oam[oid * 4 + 2];
-    uint8_t l1 = io_->vram[tid * 16 + lid * 2];
-    uint8_t l2 = io_->vram[tid * 16 + lid * 2 + 1];
+    // Rows 8-15 of a tall sprite come from the following tile.
+    int tid = io_->oam[oid * 4 + 2] + (lid >> 3);
+    const uint8_t* row = tile_(tid, N_BIT(attr, 5)) + (lid & 0x7) * 8;
     uint8_t threshold = (N_BIT(attr, 7) ? 0 : 3);
-    for (int j = 0; j < 8; ++j) {
-      int bufx = x + j;
-      if (bufx < 0)
-        continue;
-      if (bufx >= 160)
-        break;
-      uint8_t& buf = buf_[LY * 160 + bufx];
-      if (buf > threshold)
-        continue;
-      int px = (N_BIT(attr, 5) ? j : 7 - j);
-      uint8_t c = ((l1 >> px) & 1) | (((l2 >> px) & 1) << 1);
-      buf = ((N_BIT(attr, 4) << 2 ) | c) + 4;
+    uint8_t pal = (N_BIT(attr, 4) << 2) + 4;
+    if (x >= 0 && x <= 152) {
+      mergeSprite(buf_ + LY * 160 + x, row, pal, threshold);
+    } else if (x < 0) {
+      mergeSpriteScalar(buf_ + LY * 160, row - x, std::max(0, 8 + x), pal, threshold);
+    } else {
+      mergeSpriteScalar(buf_ + LY * 160 + x, row, std::max(0, 160 - x), pal, threshold);
     }
   }
 }
@@ -96,6 +237,7 @@ void Video::renderSpriteLine_(uint8_t LCDC, uint8_t LY) {
 const uint8_t COLOR[] = { 240, 180, 100, 10 };
 
 void Video::renderLine_(uint8_t LCDC, uint8_t LY) {
+  buf_ = cowOwn(buf_);
   if ((LCDC & 0x1) == 0x1) {
     renderBackgroundLine_(LCDC, LY);
   }
@@ -105,34 +247,62 @@ void Video::renderLine_(uint8_t LCDC, uint8_t LY) {
   }
 
   uint32_t palette = io_->reg(IO::BGP) | (io_->reg(IO::OBP0) << 8) | (io_->reg(IO::OBP1) << 16);
-  for (uint8_t i = 0; i < 160; ++i) {
-    uint8_t& p = buf_[LY * 160 + i];
-    p = COLOR[(palette >> (p << 1)) & 0x3];
-  }
+  alignas(16) uint8_t lut[16];
+  for (int i = 0; i < 16; ++i)
+    lut[i] = COLOR[(palette >> (i << 1)) & 0x3];
+  shadeLine(buf_ + LY * 160, lut);
   // ERR << "Video !! LCDC " << io_->reg(IO::LCDC) << endl;
   // for (uint16_t i = 0; i < 160; ++i) {
   //   buf_[LY * 160 + i] = (i + LY) & 0xFF;
   // }
 }
 
+// 64-bit hash of a picture, 8 pixels at a time. Not stable across versions
+// of the renderer's color indices, only between runs of the same build.
+static uint64_t hashFrame(const uint8_t* buf) {
+  uint64_t h = 0x9E3779B97F4A7C15ull;
+  for (int i = 0; i < 144 * 160; i += 8) {
+    uint64_t word;
+    memcpy(&word, buf + i, sizeof(word));
+    h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
 void Video::drawFrame_(uint8_t LCDC) {
   // ERR << "Video !! LCDC " << LCDC << " " << (LCDC & 0x80) << " " << ((LCDC & 0x80) != 0x80) << endl;
   if ((LCDC & 0x80) != 0x80) {
     // ERR << "Video RESET" << endl;
     // memset(buf_, 0, sizeof(buf_));
   }
-  renderCanvas(canvasId_, buf_);
-}
-
-void Video::runCycles(int cycles) {
-  uint8_t LCDC = io_->reg(IO::LCDC);
-  if ((LCDC & 0x80) != 0x80)
+  if (!present_ || skipping_ || output_ == OUTPUT_NONE)
     return;
-
-  timing_ -= cycles;
-  if (timing_ > 0)
+  if (output_ & OUTPUT_HASH)
+    frameHash_ = hashFrame(buf_);
+  if (!(output_ & (OUTPUT_CANVAS | OUTPUT_FRAME)))
     return;
+  if (frames_ == nullptr)
+    frames_ = allocFrames();
+  framesUsed_ = true;
+  uint32_t* back = frames_[front_ ^ 1];
+  for (int i = 0; i < 144 * 160; ++i)
+    back[i] = pixel_[buf_[i]];
+  front_ ^= 1;
+  if (output_ & OUTPUT_CANVAS)
+    renderCanvas(canvasId_, reinterpret_cast<uint8_t*>(back));
+}
+
+void Video::resetTimer() {
+  if ((io_->reg(IO::LCDC) & 0x80) == 0x80)
+    sched_->schedule(Scheduler::EVENT_VIDEO, sched_->now());
+  else
+    sched_->cancel(Scheduler::EVENT_VIDEO);
+}
 
+void Video::onEvent(uint64_t at) {
+  uint8_t LCDC = io_->reg(IO::LCDC);
+  ++io_->events;
   uint8_t& STAT = io_->reg(IO::STAT);
   uint8_t& LY = io_->reg(IO::LY);
   uint8_t LYC = io_->reg(IO::LYC);
@@ -149,6 +319,11 @@ void Video::runCycles(int cycles) {
       if (LY == 154) {
         drawFrame_(LCDC);
         LY = 0;
+        if (!skipping_)
+          skipLeft_ = skip_;
+        skipping_ = skipLeft_ > 0;
+        if (skipping_)
+          --skipLeft_;
         mod = (LCDC & 0x80 ? 2 : 1);
       }
       LY_intr = true;
@@ -158,7 +333,10 @@ void Video::runCycles(int cycles) {
       mod = 3;
       break;
     case 3:
-      renderLine_(LCDC, LY);
+      if (render_ && !skipping_ && output_ != OUTPUT_NONE) {
+        renderLine_(LCDC, LY);
+        lineDirty_[LY] = true;
+      }
       ++LY;
       mod = 0;
       mod_intr = true;
@@ -167,7 +345,7 @@ void Video::runCycles(int cycles) {
     default:
       throw 1;
   }
-  timing_ += MOD_CYCLES[mod];
+  sched_->schedule(Scheduler::EVENT_VIDEO, at + MOD_CYCLES[mod]);
   STAT = (STAT & 0xF8) | ((LY == LYC) << 2) | mod;
   if (mod_intr && mod == 1) {
     io_->requestInterrupt(IO::IRQ_VBLANK);
@@ -179,3 +357,88 @@ void Video::runCycles(int cycles) {
     io_->requestInterrupt(IO::IRQ_LCDC);
   }
 }
+
+// The mode timing lives in IO and the scheduler; only the frame being drawn
+// is kept here.
+void Video::serialize(Snapshot* state) {
+  if (state->bulk()) {
+    if (state->loading()) {
+      buf_ = cowOwn(buf_);
+      // Every line may differ from the run-ahead shadow now.
+      memset(lineDirty_, 1, sizeof(lineDirty_));
+    }
+    state->bytes(buf_, 144 * 160);
+  }
+}
+
+void Video::setOutput(bool render, bool present) {
+  render_ = render;
+  present_ = present;
+}
+
+void Video::setOutputTarget(uint8_t output) {
+  output_ = output;
+  // Headless from the start: the blank frames would never be read, and are
+  // allocated again with the first picture that is.
+  if (!(output & (OUTPUT_CANVAS | OUTPUT_FRAME)) && !framesUsed_) {
+    arenaFree(frames_);
+    frames_ = nullptr;
+  }
+}
+
+void Video::setColors(const uint32_t colors[4]) {
+  for (int i = 0; i < 4; ++i)
+    pixel_[COLOR[i]] = colors[i];
+}
+
+void Video::setBackgroundCache(bool on) {
+  if (on == (bgMaps_ != nullptr))
+    return;
+  if (!on) {
+    arenaFree(bgMaps_);
+    bgMaps_ = nullptr;
+    return;
+  }
+  // Every cell starts out naming no tile, so the first sync draws it all.
+  bgMaps_ = static_cast<BackgroundMap*>(arenaAlloc(2 * sizeof(BackgroundMap)));
+  for (int map = 0; map < 2; ++map) {
+    BackgroundMap& bg = bgMaps_[map];
+    memset(bg.tile, 0xFF, sizeof(bg.tile));
+    memset(bg.dirty, 0, sizeof(bg.dirty));
+    bg.unsignedData = true;
+    for (int page = 0; page < 4; ++page)
+      bg.mapGen[page] = mem_->writeGen(0x9800 + map * 0x400 + page * 0x100) - 1;
+    for (int page = 0; page < TILES / 16; ++page)
+      bg.tileGen[page] = mem_->writeGen(0x8000 + page * 0x100);
+  }
+}
+
+void Video::setFrameSkip(int skip) {
+  skip_ = skip;
+  skipLeft_ = std::min(skipLeft_, skip);
+}
+
+void Video::checkpoint() {
+  if (shadow_ == nullptr) {
+    shadow_ = static_cast<uint8_t*>(arenaAlloc(144 * 160));
+    memcpy(shadow_, buf_, 144 * 160);
+    memset(lineDirty_, 0, sizeof(lineDirty_));
+    return;
+  }
+  for (int line = 0; line < 144; ++line) {
+    if (lineDirty_[line]) {
+      memcpy(shadow_ + line * 160, buf_ + line * 160, 160);
+      lineDirty_[line] = false;
+    }
+  }
+}
+
+void Video::restore() {
+  buf_ = cowOwn(buf_);
+  for (int line = 0; line < 144; ++line) {
+    if (lineDirty_[line]) {
+      memcpy(buf_ + line * 160, shadow_ + line * 160, 160);
+      lineDirty_[line] = false;
+    }
+  }
+}
@@ -0,0 +1,92 @@
+#include "arena.h"
+#include "gameboy.h"
+
+#include "test.h"
+
+#include <thread>
+#include <vector>
+
+static bool inside(const Arena& arena, const void* base, const void* p) {
+  const uint8_t* b = static_cast<const uint8_t*>(base);
+  return p >= b && p < b + arena.size();
+}
+
+// Blocks are aligned and carved in order; the last one goes back at once,
+// others only on reset(), and blocks of another thread's arena not at all.
+static void allocates() {
+  Arena arena(1 << 16);
+  ArenaScope scope(&arena);
+  void* a = arenaAlloc(1);
+  void* b = arenaAlloc(100);
+  CHECK(reinterpret_cast<uintptr_t>(a) % 16 == 0);
+  CHECK(reinterpret_cast<uintptr_t>(b) % 16 == 0);
+  CHECK(b > a);
+  size_t used = arena.used();
+  arenaFree(a);
+  CHECK(arena.used() == used);
+  std::thread([b] { arenaFree(b); }).join();
+  CHECK(arena.used() == used);
+  arenaFree(b);
+  CHECK(arena.used() < used);
+  arena.reset();
+  CHECK(arena.used() == 0);
+  CHECK(arenaAlloc(1) == a);
+  arena.reset();
+}
+
+// What does not fit comes from the heap, and goes back to it.
+static void spills() {
+  Arena arena(256);
+  ArenaScope scope(&arena);
+  void* first = arenaAlloc(64);
+  void* big = arenaAlloc(1024);
+  CHECK(!inside(arena, first, big));
+  size_t used = arena.used();
+  arenaFree(big);
+  CHECK(arena.used() == used);
+  void* none;
+  {
+    ArenaScope heap(nullptr);
+    none = arenaAlloc(16);
+  }
+  CHECK(arena.used() == used);
+  arenaFree(none);
+  arena.reset();
+}
+
+static std::vector<uint8_t> run(Gameboy* gb) {
+  const uint8_t input = 0x07;
+  uint32_t flags = Gameboy::EXEC_HOLD_INPUT | Gameboy::EXEC_HASH | Gameboy::EXEC_WRAM;
+  std::vector<uint8_t> records(Gameboy::frameRecordSize(flags) * 30);
+  gb->setBackgroundCache(true);
+  gb->runAhead(input, 2);
+  CHECK(gb->executeFrames(30, &input, flags, records.data(), records.size()) == 30);
+  return records;
+}
+
+// A machine built in an arena keeps all it allocates there and runs as one
+// built on the heap.
+static void holdsMachines() {
+  Gameboy heap(cartridge(vblankRom()), 0);
+  std::vector<uint8_t> want = run(&heap);
+
+  Arena arena(4 << 20);
+  for (int episode = 0; episode < 3; ++episode) {
+    ArenaScope scope(&arena);
+    void* slot = arenaAlloc(sizeof(Gameboy));
+    Gameboy* gb = new (slot) Gameboy(cartridge(vblankRom()), 0);
+    CHECK(run(gb) == want);
+    // Block cache, pages, picture, frames, background maps and shadows.
+    CHECK(arena.used() > sizeof(Gameboy) + (1 << 18));
+    gb->~Gameboy();
+    arenaFree(slot);
+    arena.reset();
+  }
+}
+
+int main() {
+  allocates();
+  spills();
+  holdsMachines();
+  return testResult("arena_test");
+}
@@ -0,0 +1,59 @@
+#include "batch.h"
+
+#include "test.h"
+
+#include <vector>
+
+static void rejectsEmpty() {
+  for (int count : {0, -1}) {
+    bool threw = false;
+    try {
+      GameboyBatch batch(vblankRom(), 0x8000, count);
+    } catch (int) {
+      threw = true;
+    }
+    CHECK(threw);
+  }
+}
+
+// Headless machines allocate their RGBA frames only to observe pictures,
+// and observations match separate machines stepped the same way.
+static void observations() {
+  const int count = 8, steps = 30, frames = 4;
+  GameboyBatch batch(vblankRom(), 0x8000, count);
+  for (int i = 0; i < count; ++i)
+    CHECK(batch[i].frame() == nullptr);
+  const uint16_t addrs[] = {0xFF80, 0xC100};
+  batch.setObservation(addrs, 2, GameboyBatch::OBS_PICTURE);
+  batch.setDone(0xFF80, 0x80, 0x80);
+  size_t size = batch.observationSize();
+  CHECK(size == 3 + 144 * 160);
+  std::vector<Gameboy*> plain;
+  for (int i = 0; i < count; ++i) {
+    plain.push_back(new Gameboy(cartridge(vblankRom()), 0));
+    plain.back()->setHeadless(true, false, 1);
+  }
+  std::vector<uint8_t> actions(count), out(size * count), picture(144 * 160);
+  for (int step = 0; step < steps; ++step) {
+    for (int i = 0; i < count; ++i)
+      actions[i] = (step + i) % 3 ? 0xFF : 0xEF;
+    batch.step(actions.data(), frames, out.data());
+    for (int i = 0; i < count; ++i) {
+      plain[i]->executeFrames(frames, &actions[i], Gameboy::EXEC_HOLD_INPUT | Gameboy::EXEC_KEEP_LAST, nullptr, 0);
+      const uint8_t* obs = out.data() + i * size;
+      CHECK(obs[0] == ((plain[i]->peek(0xFF80) & 0x80) == 0x80));
+      CHECK(obs[1] == plain[i]->peek(0xFF80));
+      CHECK(obs[2] == plain[i]->peek(0xC100));
+      plain[i]->pictureShades(picture.data());
+      CHECK(memcmp(obs + 3, picture.data(), picture.size()) == 0);
+    }
+  }
+  for (Gameboy* gb : plain)
+    delete gb;
+}
+
+int main() {
+  rejectsEmpty();
+  observations();
+  return testResult("batch_test");
+}
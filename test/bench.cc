@@ -0,0 +1,178 @@
+#include "gameboy.h"
+#include "pixels.h"
+#include "runner.h"
+
+#include "test.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Native benchmarks behind the numbers quoted in commit messages. Run
+// `make bench`, or `make bench BENCH="cpu state"` for some of them. Each
+// figure is the best of 5 runs.
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Frames per second over frames frames of a fresh machine, set up by setup.
+template <typename Setup>
+static double fps(uint8_t* (*makeRom)(), int frames, Setup setup) {
+  double best = 0;
+  for (int run = 0; run < 5; ++run) {
+    Gameboy gb(cartridge(makeRom()), 0);
+    setup(&gb);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i)
+      gb.executeSingleFrame(0xFF);
+    best = std::max(best, frames / seconds(start));
+  }
+  return best;
+}
+
+static double fps(uint8_t* (*makeRom)(), int frames) {
+  return fps(makeRom, frames, [](Gameboy*) {});
+}
+
+// The CPU: dispatch, block cache and lazy flags.
+static void benchCpu() {
+  printf("alu loop            %8.0f fps\n", fps(aluRom, 3000));
+  printf("vblank halt         %8.0f fps\n", fps(vblankRom, 3000));
+}
+
+// A bank switch and a read from the new bank every few instructions.
+static void benchBanks() {
+  printf("mbc5 bank switch    %8.0f fps\n", fps(bankRom, 3000));
+}
+
+static void benchHeadless() {
+  printf("canvas              %8.0f fps\n", fps(vblankRom, 3000));
+  printf("headless            %8.0f fps\n",
+         fps(vblankRom, 3000, [](Gameboy* gb) { gb->setHeadless(true, false, 1); }));
+  printf("headless, hashed    %8.0f fps\n",
+         fps(vblankRom, 3000, [](Gameboy* gb) { gb->setHeadless(true, true, 1); }));
+}
+
+static void benchState() {
+  Gameboy gb(cartridge(vblankRom()), 0);
+  for (int i = 0; i < 10; ++i)
+    gb.executeSingleFrame(0xFF);
+  std::vector<uint8_t> state(gb.stateSize());
+  const int n = 20000;
+  double save = 1e9, load = 1e9;
+  for (int run = 0; run < 5; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i)
+      gb.saveState(state.data(), state.size());
+    save = std::min(save, seconds(start) / n);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i)
+      gb.loadState(state.data(), state.size());
+    load = std::min(load, seconds(start) / n);
+  }
+  printf("save state          %8.2f us (%zu bytes)\n", save * 1e6, state.size());
+  printf("load state          %8.2f us\n", load * 1e6);
+}
+
+// Per call, so that the kernels can be compared without the rest.
+template <typename Kernel>
+static double perCall(Kernel kernel) {
+  const int n = 200000;
+  double best = 1e9;
+  for (int run = 0; run < 5; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i)
+      kernel(i);
+    best = std::min(best, seconds(start) / n);
+  }
+  return best * 1e9;
+}
+
+static void benchPixels() {
+  alignas(16) uint8_t lut[16];
+  alignas(16) uint8_t line[160];
+  for (int i = 0; i < 160; ++i)
+    line[i] = i * 7;
+  for (int i = 0; i < 16; ++i)
+    lut[i] = i * 13;
+  printf("shade line scalar   %8.1f ns\n", perCall([&](int i) {
+    lut[0] = i;
+    shadeLineScalar(line, lut);
+  }));
+  printf("shade line %-8s %8.1f ns\n", PIXELS_SIMD, perCall([&](int i) {
+    lut[0] = i;
+    shadeLine(line, lut);
+  }));
+#ifdef PIXELS_VECTOR
+  printf("shade line vector   %8.1f ns\n", perCall([&](int i) {
+    lut[0] = i;
+    shadeLineVector(line, lut);
+  }));
+#endif
+  const uint8_t row[8] = {0, 1, 2, 3, 3, 2, 1, 0};
+  printf("sprite row scalar   %8.1f ns\n",
+         perCall([&](int i) { mergeSpriteScalar(line + (i & 63), row, 8, 4, 3); }));
+  printf("sprite row %-8s %8.1f ns\n", PIXELS_SIMD,
+         perCall([&](int i) { mergeSprite(line + (i & 63), row, 4, 3); }));
+  volatile uint8_t sink = line[0];
+  (void)sink;
+}
+
+// Runner throughput from one thread up to every core, with the speedup
+// over one thread. Episodes mix ROMs and lengths so that stealing matters.
+static void benchRunner() {
+  uint8_t* roms[] = {aluRom(), vblankRom(), bankRom(), pollRom()};
+  std::vector<uint8_t> inputs(1200, 0xFF);
+  std::vector<Runner::Episode> episodes;
+  for (int i = 0; i < 32; ++i) {
+    uint8_t* rom = roms[i % 4];
+    episodes.push_back({rom, romSize(rom), 120 + (i * 37) % 480, inputs.data(), 0, 0, false});
+  }
+  // 1, 2, 4... up to the core count, and the core count itself; at least 2
+  // so that the threading overhead shows on a single core.
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> counts = {1};
+  while (counts.back() * 2 <= std::max(cores, 2))
+    counts.push_back(counts.back() * 2);
+  if (counts.back() < cores)
+    counts.push_back(cores);
+  printf("runner, %d cores:\n", cores);
+  double single = 0;
+  for (int threads : counts) {
+    double best = 0;
+    for (int run = 0; run < 3; ++run) {
+      Runner runner(threads);
+      runner.run(&episodes);
+      best = std::max(best, runner.framesPerSecond());
+    }
+    if (threads == 1)
+      single = best;
+    printf("  %3d threads        %8.0f fps  x%.2f\n", threads, best, best / single);
+  }
+  for (uint8_t* rom : roms)
+    free(rom);
+}
+
+int main(int argc, char* argv[]) {
+  struct {
+    const char* name;
+    void (*run)();
+  } BENCHES[] = {
+      {"cpu", benchCpu},
+      {"banks", benchBanks},
+      {"headless", benchHeadless},
+      {"state", benchState},
+      {"pixels", benchPixels},
+      {"runner", benchRunner},
+  };
+  for (auto& bench : BENCHES) {
+    bool selected = argc <= 1;
+    for (int i = 1; i < argc; ++i)
+      selected |= std::string(argv[i]) == bench.name;
+    if (selected)
+      bench.run();
+  }
+  return 0;
+}
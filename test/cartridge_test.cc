@@ -0,0 +1,114 @@
+#include "cartridge.h"
+
+#include "test.h"
+
+// A ROM whose banks start with their own number, low byte first.
+static uint8_t* markedRom(uint8_t type, uint8_t romSize, uint8_t ramSize) {
+  static const uint8_t PROG[] = {0x00};
+  uint8_t* rom = makeRom(PROG, sizeof(PROG), type, romSize, ramSize);
+  for (size_t bank = 0; bank < ::romSize(rom) / 0x4000; ++bank) {
+    rom[bank * 0x4000] = bank;
+    rom[bank * 0x4000 + 1] = bank >> 8;
+  }
+  return rom;
+}
+
+// Bank mapped at 0x4000-0x7FFF, by its mark.
+static uint32_t romBank(Cartridge* cart) {
+  const uint8_t* data = cart->romData(0x4000);
+  uint32_t bank = data[0] | data[1] << 8;
+  CHECK(cart->romBank() == bank);
+  return bank;
+}
+
+// RAM bank mapped at 0xA000-0xBFFF, or -1 for none.
+static int ramBank(Cartridge* cart) {
+  uint8_t* data = cart->ramData();
+  return data ? (data - cart->saveRam()) / 0x2000 : -1;
+}
+
+static void mbc1() {
+  uint8_t* rom = markedRom(0x03, 6, 3);
+  Cartridge cart(rom, ::romSize(rom));
+  CHECK(romBank(&cart) == 1);
+  CHECK(cart.write(0x2000, 5) == Cartridge::REMAP_ROM);
+  CHECK(romBank(&cart) == 5);
+  CHECK(cart.write(0x2000, 5) == Cartridge::REMAP_NONE);
+  // Bank 0 of the low five bits reads as bank 1, also with bits above.
+  cart.write(0x2000, 0);
+  CHECK(romBank(&cart) == 1);
+  cart.write(0x2000, 0x20);
+  CHECK(romBank(&cart) == 1);
+  cart.write(0x4000, 1);
+  CHECK(romBank(&cart) == 0x21);
+  cart.write(0x2000, 3);
+  CHECK(romBank(&cart) == 0x23);
+
+  // RAM is off until enabled; writes and reads meanwhile do nothing.
+  CHECK(ramBank(&cart) == -1);
+  cart.writeRam(0, 0x55);
+  CHECK(cart.readRam(0) == 0xFF);
+  CHECK(cart.write(0x0000, 0x0A) == Cartridge::REMAP_RAM);
+  CHECK(cart.saveRam()[0] == 0);
+  // Mode 0 maps RAM bank 0 whatever the register says; mode 1 banks it.
+  CHECK(ramBank(&cart) == 0);
+  CHECK(cart.write(0x6000, 1) == Cartridge::REMAP_RAM);
+  CHECK(ramBank(&cart) == 1);
+  cart.write(0x4000, 2);
+  CHECK(ramBank(&cart) == 2);
+  CHECK(cart.write(0x0000, 0x00) == Cartridge::REMAP_RAM);
+  CHECK(ramBank(&cart) == -1);
+}
+
+static void mbc3() {
+  uint8_t* rom = markedRom(0x10, 6, 3);
+  Cartridge cart(rom, ::romSize(rom));
+  cart.write(0x2000, 0x45);
+  CHECK(romBank(&cart) == 0x45);
+  cart.write(0x2000, 0);
+  CHECK(romBank(&cart) == 1);
+  cart.write(0x2000, 0x80);
+  CHECK(romBank(&cart) == 1);
+
+  cart.write(0x0000, 0x0A);
+  cart.write(0x4000, 2);
+  CHECK(ramBank(&cart) == 2);
+  // Clock registers take the place of RAM and keep what is written.
+  CHECK(cart.write(0x4000, 0x08) == Cartridge::REMAP_RAM);
+  CHECK(ramBank(&cart) == -1);
+  cart.writeRam(0, 0x12);
+  CHECK(cart.readRam(0) == 0x12);
+  cart.write(0x4000, 0x09);
+  CHECK(cart.readRam(0) == 0);
+  cart.write(0x0000, 0x00);
+  cart.write(0x4000, 0x08);
+  CHECK(cart.readRam(0) == 0xFF);
+}
+
+static void mbc5() {
+  uint8_t* rom = markedRom(0x1B, 8, 4);
+  Cartridge cart(rom, ::romSize(rom));
+  // No promotion: bank 0 can be mapped high too.
+  cart.write(0x2000, 0);
+  CHECK(romBank(&cart) == 0);
+  cart.write(0x3000, 1);
+  cart.write(0x2000, 3);
+  CHECK(romBank(&cart) == 0x103);
+  cart.write(0x3000, 0);
+  CHECK(romBank(&cart) == 3);
+
+  CHECK(ramBank(&cart) == -1);
+  cart.write(0x0000, 0x0A);
+  CHECK(ramBank(&cart) == 0);
+  CHECK(cart.write(0x4000, 5) == Cartridge::REMAP_RAM);
+  CHECK(ramBank(&cart) == 5);
+  cart.write(0x4000, 0x1F);
+  CHECK(ramBank(&cart) == 15);
+}
+
+int main() {
+  mbc1();
+  mbc3();
+  mbc5();
+  return testResult("cartridge_test");
+}
@@ -0,0 +1,225 @@
+#include "cpu.h"
+#include "io.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "video.h"
+
+#include "test.h"
+
+#include <initializer_list>
+
+// The parts of a Gameboy the CPU runs against, wired as Gameboy wires them,
+// stepped an instruction at a time. Interrupts stay off, as IE is 0.
+struct Rig {
+  Scheduler sched;
+  IO io;
+  Memory mem;
+  Video video;
+  Timer timer;
+  CPU cpu;
+
+  explicit Rig(uint8_t* rom)
+      : io(&mem, &video, &timer), mem(cartridge(rom), &io), video(&io, &mem, &sched, 0), timer(&io, &sched), cpu(&mem) {
+    cpu.reg_.sp = 0xDFFE;
+  }
+  // Writes code at addr and points PC at it.
+  void load(uint16_t addr, std::initializer_list<uint8_t> code) {
+    uint16_t at = addr;
+    for (uint8_t byte : code)
+      mem.write(at++, byte);
+    cpu.reg_.pc = addr;
+  }
+  // Cycles taken by the next n instructions.
+  int step(int n = 1) {
+    int cycles = 0;
+    for (int i = 0; i < n; ++i)
+      cycles += cpu.executeSingleInst();
+    return cycles;
+  }
+};
+
+static uint8_t* nopRom() {
+  static const uint8_t PROG[] = {0x00};
+  return makeRom(PROG, sizeof(PROG));
+}
+
+const uint8_t Z = 0x80, N = 0x40, H = 0x20, C = 0x10;
+
+// Runs insts instructions of code from A and F, and checks both after them.
+static void alu(Rig* rig, uint8_t a, uint8_t f, std::initializer_list<uint8_t> code, int insts, uint8_t wantA,
+                uint8_t wantF) {
+  rig->load(0xC000, code);
+  rig->cpu.reg_.a = a;
+  rig->cpu.setFlags(f);
+  rig->step(insts);
+  CHECK(rig->cpu.reg_.a == wantA);
+  CHECK(rig->cpu.flags() == wantF);
+}
+
+static void flags() {
+  Rig rig(nopRom());
+  // DAA after an addition, a subtraction and a decimal carry.
+  rig.cpu.reg_.b = 0x38;
+  alu(&rig, 0x45, 0, {0x80, 0x27}, 2, 0x83, 0);            // ADD A,B; DAA
+  alu(&rig, 0x83, 0, {0xD6, 0x38, 0x27}, 2, 0x45, N);      // SUB 38; DAA
+  alu(&rig, 0x99, 0, {0xC6, 0x01, 0x27}, 2, 0x00, Z | C);  // ADD A,1; DAA
+  // ADC and SBC take the carry in and set half carry from the low nibble.
+  alu(&rig, 0xFF, C, {0xCE, 0x00}, 1, 0x00, Z | H | C);  // ADC A,0
+  alu(&rig, 0x00, C, {0xCE, 0x0F}, 1, 0x10, H);          // ADC A,0F
+  alu(&rig, 0x00, C, {0xDE, 0x00}, 1, 0xFF, N | H | C);  // SBC A,0
+  alu(&rig, 0x10, 0, {0xDE, 0x01}, 1, 0x0F, N | H);      // SBC A,1
+  alu(&rig, 0x10, C, {0xDE, 0x0F}, 1, 0x00, Z | N | H);  // SBC A,0F
+  // INC and DEC H set Z, N and H and leave the carry alone.
+  struct {
+    uint8_t op, h, f, wantH, wantF;
+  } INC_DEC[] = {
+      {0x24, 0x0F, C, 0x10, H | C},      // INC H
+      {0x24, 0xFF, C, 0x00, Z | H | C},  // INC H
+      {0x24, 0x41, 0, 0x42, 0},          // INC H
+      {0x25, 0x10, C, 0x0F, N | H | C},  // DEC H
+      {0x25, 0x01, C, 0x00, Z | N | C},  // DEC H
+      {0x25, 0x00, 0, 0xFF, N | H},      // DEC H
+  };
+  for (auto& t : INC_DEC) {
+    rig.load(0xC000, {t.op});
+    rig.cpu.reg_.h = t.h;
+    rig.cpu.setFlags(t.f);
+    rig.step();
+    CHECK(rig.cpu.reg_.h == t.wantH);
+    CHECK(rig.cpu.flags() == t.wantF);
+  }
+}
+
+// B, C, D, E, H, L, (HL), A as the low three bits of a CB opcode name them.
+static uint8_t* operand(Rig* rig, int r) {
+  CPU::Register& reg = rig->cpu.reg_;
+  uint8_t* regs[] = {&reg.b, &reg.c, &reg.d, &reg.e, &reg.h, &reg.l, nullptr, &reg.a};
+  return regs[r];
+}
+
+static uint8_t value(Rig* rig, int r) {
+  return r == 6 ? rig->mem.read(rig->cpu.reg_.hl) : *operand(rig, r);
+}
+
+// Whether operand i stays put when r changes; (HL) moves with H and L.
+static bool independent(int i, int r) {
+  return i != r && !(i == 6 && (r == 4 || r == 5));
+}
+
+// RES, BIT and SET change only their bit of their own operand, L and (HL)
+// included, and BIT sets Z, clears N, sets H and keeps the carry.
+static void bitOps() {
+  Rig rig(nopRom());
+  for (int r = 0; r < 8; ++r) {
+    for (int b = 0; b < 8; ++b) {
+      uint8_t op = b << 3 | r;
+      rig.load(0xC000, {0xCB, uint8_t(0x80 | op), 0xCB, uint8_t(0x40 | op), 0xCB, uint8_t(0xC0 | op), 0xCB,
+                        uint8_t(0x40 | op)});
+      rig.cpu.reg_.bc = 0xB1B2;
+      rig.cpu.reg_.de = 0xD1D2;
+      rig.cpu.reg_.hl = 0xC1FF;
+      rig.cpu.reg_.a = 0xA1;
+      rig.mem.write(0xC1FF, 0xFF);
+      rig.cpu.setFlags(C);
+      uint8_t before[8];
+      for (int i = 0; i < 8; ++i)
+        before[i] = value(&rig, i);
+
+      rig.step();  // RES
+      for (int i = 0; i < 8; ++i)
+        CHECK(i == r ? value(&rig, i) == (before[i] & ~(1 << b)) : !independent(i, r) || value(&rig, i) == before[i]);
+      rig.step();  // BIT
+      CHECK(rig.cpu.flags() == (Z | H | C));
+      rig.step(2);  // SET, BIT
+      CHECK(rig.cpu.flags() == (H | C));
+      for (int i = 0; i < 8; ++i)
+        CHECK(i == r ? value(&rig, i) == (before[i] | 1 << b) : !independent(i, r) || value(&rig, i) == before[i]);
+    }
+  }
+}
+
+// Conditional branches take longer when taken, and land where they should.
+static void branchCycles() {
+  Rig rig(nopRom());
+  struct {
+    std::initializer_list<uint8_t> code;
+    int taken, notTaken;
+    uint16_t target;
+  } BRANCHES[] = {
+      {{0x20, 0x10}, 12, 8, 0xC012},        // JR NZ,+10
+      {{0xC2, 0x34, 0xC0}, 16, 12, 0xC034},  // JP NZ,C034
+      {{0xC0}, 20, 8, 0xC1C0},               // RET NZ
+  };
+  for (auto& branch : BRANCHES) {
+    for (bool taken : {true, false}) {
+      rig.load(0xC000, branch.code);
+      rig.cpu.reg_.sp = 0xDFF0;
+      rig.mem.write16(0xDFF0, 0xC1C0);
+      rig.cpu.setFlags(taken ? 0 : Z);
+      CHECK(rig.step() == (taken ? branch.taken : branch.notTaken));
+      CHECK(rig.cpu.reg_.pc == (taken ? branch.target : 0xC000 + branch.code.size()));
+    }
+  }
+}
+
+// Code that rewrites its own next instruction runs the new one, in the
+// same pass and when the block is entered again.
+static void selfModifyingCode() {
+  Rig rig(nopRom());
+  rig.load(0xC000, {
+                       0x3E, 0x0C,        // LD A,0C (INC C)
+                       0xEA, 0x05, 0xC0,  // LD (C005),A
+                       0x04,              // INC B, rewritten to INC C
+                       0xC3, 0x00, 0xC0,  // JP C000
+                   });
+  rig.cpu.reg_.bc = 0;
+  rig.step(4);
+  CHECK(rig.cpu.reg_.b == 0);
+  CHECK(rig.cpu.reg_.c == 1);
+  rig.step(4);
+  CHECK(rig.cpu.reg_.b == 0);
+  CHECK(rig.cpu.reg_.c == 2);
+  // Once more with the opcode written back from outside.
+  rig.mem.write(0xC001, 0x04);
+  rig.step(4);
+  CHECK(rig.cpu.reg_.b == 1);
+  CHECK(rig.cpu.reg_.c == 2);
+}
+
+// Code at the same PC in two ROM banks runs from the bank mapped when it
+// is reached.
+static void bankedCode() {
+  uint8_t* rom = bankRom();
+  rom[1 * 0x4000] = 0x04;  // INC B
+  rom[1 * 0x4000 + 1] = 0xC9;  // RET
+  rom[2 * 0x4000] = 0x0C;  // INC C
+  rom[2 * 0x4000 + 1] = 0xC9;  // RET
+  Rig rig(rom);
+  rig.load(0xC000, {
+                       0xCD, 0x00, 0x40,  // CALL 4000
+                       0x3E, 0x02,        // LD A,2
+                       0xEA, 0x00, 0x20,  // LD (2000),A
+                       0xCD, 0x00, 0x40,  // CALL 4000
+                       0x3E, 0x01,        // LD A,1
+                       0xEA, 0x00, 0x20,  // LD (2000),A
+                       0xCD, 0x00, 0x40,  // CALL 4000
+                   });
+  rig.cpu.reg_.bc = 0;
+  rig.step(3);
+  CHECK(rig.cpu.reg_.b == 1 && rig.cpu.reg_.c == 0);
+  rig.step(5);
+  CHECK(rig.cpu.reg_.b == 1 && rig.cpu.reg_.c == 1);
+  rig.step(5);
+  CHECK(rig.cpu.reg_.b == 2 && rig.cpu.reg_.c == 1);
+  CHECK(rig.cpu.reg_.pc == 0xC013);
+}
+
+int main() {
+  flags();
+  bitOps();
+  branchCycles();
+  selfModifyingCode();
+  bankedCode();
+  return testResult("cpu_test");
+}
@@ -0,0 +1,116 @@
+#include "gameboy.h"
+
+#include "test.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+const uint32_t FLAGS = Gameboy::EXEC_HASH | Gameboy::EXEC_WRAM;
+
+// Records of n frames from frame i on, with input that changes every frame.
+static std::vector<uint8_t> records(Gameboy* gb, int n) {
+  std::vector<uint8_t> inputs(n), out(Gameboy::frameRecordSize(FLAGS) * n);
+  for (int i = 0; i < n; ++i)
+    inputs[i] = i % 3 ? 0xFF : 0xEE;
+  CHECK(gb->executeFrames(n, inputs.data(), FLAGS, out.data(), out.size()) == n);
+  return out;
+}
+
+static std::vector<uint8_t> state(Gameboy* gb) {
+  std::vector<uint8_t> state(gb->stateSize());
+  gb->saveState(state.data(), state.size());
+  return state;
+}
+
+static std::unique_ptr<Gameboy> started(uint8_t* (*makeRom)()) {
+  std::unique_ptr<Gameboy> gb(new Gameboy(cartridge(makeRom()), 0));
+  for (int i = 0; i < 10; ++i)
+    gb->executeSingleFrame(0xFF);
+  return gb;
+}
+
+// A fork goes on exactly as its parent does.
+static void runsAsParent(uint8_t* (*makeRom)()) {
+  std::unique_ptr<Gameboy> parent = started(makeRom);
+  std::unique_ptr<Gameboy> fork(parent->fork());
+  CHECK(state(fork.get()) == state(parent.get()));
+  CHECK(records(fork.get(), 40) == records(parent.get(), 40));
+  CHECK(state(fork.get()) == state(parent.get()));
+}
+
+// What either machine writes, to VRAM, WRAM or cartridge RAM, the other
+// does not see. vblankRom writes 8000, 9805 and C100, batteryRom A000.
+static void isolates(uint8_t* (*makeRom)(), bool forkWrites) {
+  static const uint16_t WRITTEN[] = {0x8000, 0x9805, 0xC100, 0xA000};
+  std::unique_ptr<Gameboy> parent = started(makeRom);
+  std::unique_ptr<Gameboy> fork(parent->fork());
+  Gameboy* writer = forkWrites ? fork.get() : parent.get();
+  Gameboy* other = forkWrites ? parent.get() : fork.get();
+  std::vector<uint8_t> before = state(other);
+  uint8_t bytes[4], save = other->saveRamSize() ? other->saveRam()[0] : 0;
+  for (int i = 0; i < 4; ++i)
+    bytes[i] = other->peek(WRITTEN[i]);
+
+  for (int i = 0; i < 5; ++i)
+    writer->executeSingleFrame(0xEE);
+  CHECK(state(writer) != before);
+  CHECK(state(other) == before);
+  for (int i = 0; i < 4; ++i)
+    CHECK(other->peek(WRITTEN[i]) == bytes[i]);
+  if (other->saveRamSize()) {
+    CHECK(other->saveRam()[0] == save);
+    CHECK(writer->saveRam()[0] != save);
+  }
+  // And the other one still runs as it would have.
+  std::unique_ptr<Gameboy> fresh = started(makeRom);
+  CHECK(records(other, 20) == records(fresh.get(), 20));
+}
+
+// Any machine of a family can be deleted first; the others run on.
+static void deleteOrder() {
+  std::unique_ptr<Gameboy> reference = started(vblankRom);
+  std::vector<uint8_t> want = records(reference.get(), 30);
+
+  // The parent first.
+  std::unique_ptr<Gameboy> parent = started(vblankRom);
+  std::unique_ptr<Gameboy> fork(parent->fork());
+  std::unique_ptr<Gameboy> grandchild(fork->fork());
+  parent.reset();
+  CHECK(records(fork.get(), 30) == want);
+  CHECK(records(grandchild.get(), 30) == want);
+
+  // A middle one first: its parent and child still share pages with each
+  // other.
+  parent = started(vblankRom);
+  fork.reset(parent->fork());
+  grandchild.reset(fork->fork());
+  fork.reset();
+  CHECK(records(parent.get(), 30) == want);
+  CHECK(records(grandchild.get(), 30) == want);
+}
+
+// A fork runs on another thread while its parent runs on this one, both
+// writing pages they started out sharing.
+static void otherThread() {
+  std::unique_ptr<Gameboy> parent = started(batteryRom);
+  std::unique_ptr<Gameboy> fork(parent->fork());
+  std::vector<uint8_t> forked;
+  std::thread worker([&] { forked = records(fork.get(), 60); });
+  std::vector<uint8_t> own = records(parent.get(), 60);
+  worker.join();
+  CHECK(forked == own);
+  CHECK(state(fork.get()) == state(parent.get()));
+}
+
+int main() {
+  runsAsParent(vblankRom);
+  runsAsParent(batteryRom);
+  for (bool forkWrites : {false, true}) {
+    isolates(vblankRom, forkWrites);
+    isolates(batteryRom, forkWrites);
+  }
+  deleteOrder();
+  otherThread();
+  return testResult("fork_test");
+}
@@ -0,0 +1,69 @@
+#include "gameboy.h"
+
+#include "test.h"
+
+#include <vector>
+
+// Headless mode borrows the frame skip for its every-nth picture and gives
+// the caller's settings back when it ends.
+static void headlessKeepsFrameSkip() {
+  Gameboy gb(cartridge(vblankRom()), 0);
+  gb.setFrameSkip(2, 0);
+  CHECK(gb.frameSkip() == 2);
+  gb.setHeadless(true, true, 1);
+  CHECK(gb.frameSkip() == 0);
+  gb.setHeadless(true, true, 4);
+  CHECK(gb.frameSkip() == 3);
+  gb.setHeadless(false, false, 1);
+  CHECK(gb.frameSkip() == 2);
+  // Leaving twice changes nothing.
+  gb.setHeadless(false, false, 1);
+  CHECK(gb.frameSkip() == 2);
+}
+
+// A count of 0 or less runs nothing, whatever the record size.
+static void nothingToRun() {
+  Gameboy gb(cartridge(vblankRom()), 0);
+  uint8_t input = 0xFF;
+  uint8_t out[8];
+  CHECK(gb.executeFrames(0, &input, Gameboy::EXEC_HOLD_INPUT, nullptr, 0) == 0);
+  CHECK(gb.executeFrames(-1, &input, Gameboy::EXEC_HOLD_INPUT | Gameboy::EXEC_HASH, out, sizeof(out)) == 0);
+  CHECK(gb.executeFrames(-5, &input, Gameboy::EXEC_HOLD_INPUT, nullptr, 0) == 0);
+  CHECK(gb.cycles() == 0);
+  CHECK(gb.executeFrames(3, &input, Gameboy::EXEC_HOLD_INPUT, nullptr, 0) == 3);
+  CHECK(gb.executeFrames(3, &input, Gameboy::EXEC_HOLD_INPUT | Gameboy::EXEC_HASH, out, sizeof(out)) == 1);
+}
+
+// Picture records hold what a machine run a frame at a time shows after
+// each frame, alongside the other records.
+static void pictureRecords() {
+  const int n = 40;
+  uint8_t inputs[n];
+  for (int i = 0; i < n; ++i)
+    inputs[i] = i % 5 ? 0xFF : 0xEF;
+  uint32_t flags = Gameboy::EXEC_PICTURE | Gameboy::EXEC_WRAM;
+  size_t record = Gameboy::frameRecordSize(flags);
+  CHECK(record == 0x2000 + 144 * 160);
+  std::vector<uint8_t> out(record * n);
+  Gameboy batched(cartridge(vblankRom()), 0);
+  batched.setHeadless(true, false, 1);
+  CHECK(batched.executeFrames(n, inputs, flags, out.data(), out.size()) == n);
+  Gameboy plain(cartridge(vblankRom()), 0);
+  std::vector<uint8_t> picture(144 * 160);
+  bool changed = false;
+  for (int i = 0; i < n; ++i) {
+    plain.executeSingleFrame(inputs[i]);
+    plain.pictureShades(picture.data());
+    const uint8_t* rec = out.data() + i * record + 0x2000;
+    CHECK(memcmp(rec, picture.data(), picture.size()) == 0);
+    changed |= i > 0 && memcmp(rec, rec - record, picture.size()) != 0;
+  }
+  CHECK(changed);
+}
+
+int main() {
+  headlessKeepsFrameSkip();
+  nothingToRun();
+  pictureRecords();
+  return testResult("frames_test");
+}
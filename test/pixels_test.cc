@@ -0,0 +1,64 @@
+#include "pixels.h"
+
+#include "test.h"
+
+#include <random>
+
+// Every kernel against its scalar reference: the one this target uses, and
+// the vector-extension one that the simd128 build uses.
+
+static void shade(std::mt19937* rng) {
+  alignas(16) uint8_t lut[16];
+  uint8_t in[160], expected[160], line[160];
+  for (int round = 0; round < 20000; ++round) {
+    for (int i = 0; i < 16; ++i)
+      lut[i] = (*rng)();
+    for (int i = 0; i < 160; ++i)
+      in[i] = round < 2 ? (i + round * 160) & 0xFF : (*rng)();
+    memcpy(expected, in, 160);
+    shadeLineScalar(expected, lut);
+    memcpy(line, in, 160);
+    shadeLine(line, lut);
+    CHECK(memcmp(line, expected, 160) == 0);
+#ifdef PIXELS_VECTOR
+    memcpy(line, in, 160);
+    shadeLineVector(line, lut);
+    CHECK(memcmp(line, expected, 160) == 0);
+#endif
+  }
+}
+
+static void merge(std::mt19937* rng) {
+  uint8_t in[8], row[8], expected[8], dst[8];
+  for (int round = 0; round < 200000; ++round) {
+    for (int i = 0; i < 8; ++i) {
+      // Mostly the shades and indices lines really hold, some anything.
+      in[i] = round & 1 ? (*rng)() : (*rng)() % 12;
+      row[i] = (*rng)() & 3;
+    }
+    uint8_t pal = (*rng)() & 1 ? 4 : 8;
+    uint8_t threshold = round & 2 ? 0 : 3;
+    if (round % 7 == 0) {
+      pal = (*rng)();
+      threshold = (*rng)();
+    }
+    memcpy(expected, in, 8);
+    mergeSpriteScalar(expected, row, 8, pal, threshold);
+    memcpy(dst, in, 8);
+    mergeSprite(dst, row, pal, threshold);
+    CHECK(memcmp(dst, expected, 8) == 0);
+#ifdef PIXELS_VECTOR
+    memcpy(dst, in, 8);
+    mergeSpriteVector(dst, row, pal, threshold);
+    CHECK(memcmp(dst, expected, 8) == 0);
+#endif
+  }
+}
+
+int main() {
+  std::mt19937 rng(12345);
+  shade(&rng);
+  merge(&rng);
+  fprintf(stderr, "pixels_test: kernels %s\n", PIXELS_SIMD);
+  return testResult("pixels_test");
+}
@@ -0,0 +1,131 @@
+#include "gameboy.h"
+#include "rom.h"
+
+#include "test.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Images with the same content share one registration, and the second
+// buffer is freed at once.
+static void sharesContent() {
+  size_t before = Rom::registered();
+  uint8_t* a = vblankRom();
+  uint8_t* b = vblankRom();
+  Rom* first = Rom::acquire(a, romSize(a));
+  Rom* second = Rom::acquire(b, romSize(b));
+  CHECK(first == second);
+  CHECK(Rom::registered() == before + 1);
+  uint8_t* c = aluRom();
+  Rom* other = Rom::acquire(c, romSize(c));
+  CHECK(other != first);
+  CHECK(Rom::registered() == before + 2);
+  other->release();
+  second->release();
+  CHECK(Rom::registered() == before + 1);
+  first->release();
+  CHECK(Rom::registered() == before);
+}
+
+// A buffer borrowed first, as Runner does, and then handed to a Gameboy
+// keeps one registration, which frees the buffer with whichever handle goes
+// last; leak checkers see the rest. Other copies of the content share it.
+static void borrowedThenOwned() {
+  size_t before = Rom::registered();
+  for (bool gameboyFirst : {false, true}) {
+    uint8_t* rom = vblankRom();
+    Rom* borrowed = Rom::acquire(rom, romSize(rom), Rom::BORROWED);
+    Gameboy* gb = new Gameboy(rom, romSize(rom), 0);
+    CHECK(Rom::registered() == before + 1);
+    uint8_t* copy = vblankRom();
+    Rom* shared = Rom::acquire(copy, romSize(copy));
+    CHECK(shared == borrowed);
+    CHECK(Rom::registered() == before + 1);
+    shared->release();
+    if (gameboyFirst) {
+      delete gb;
+      CHECK(Rom::registered() == before + 1);
+      borrowed->release();
+    } else {
+      borrowed->release();
+      CHECK(Rom::registered() == before + 1);
+      delete gb;
+    }
+    CHECK(Rom::registered() == before);
+  }
+}
+
+static bool rejects(uint8_t* rom, size_t size) {
+  try {
+    Gameboy gb(rom, size, 0);
+  } catch (int) {
+    return true;
+  }
+  return false;
+}
+
+// Images shorter than two banks or than their header says are rejected
+// before they are read past their end; the Gameboy frees them.
+static void rejectsShort() {
+  static const uint8_t NOP[] = {0x00};
+  size_t before = Rom::registered();
+  CHECK(rejects(vblankRom(), 0));
+  CHECK(rejects(vblankRom(), 0x4000));
+  CHECK(rejects(makeRom(NOP, 1, 0x19, 2), 0x10000));
+  CHECK(!rejects(makeRom(NOP, 1, 0x19, 2), 0x20000));
+  CHECK(Rom::registered() == before);
+}
+
+static void writeFile(const char* path, const uint8_t* rom) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  CHECK(fd >= 0);
+  CHECK(write(fd, rom, romSize(rom)) == static_cast<ssize_t>(romSize(rom)));
+  close(fd);
+}
+
+// Mapped files are told apart by identity: the same file is mapped once,
+// and a rewritten one again, without either being read to hash it.
+static void mapsFiles() {
+  char path[] = "/tmp/rom_testXXXXXX";
+  close(mkstemp(path));
+  uint8_t* rom = vblankRom();
+  writeFile(path, rom);
+  size_t before = Rom::registered();
+  Rom* first = Rom::mapFile(path);
+  Rom* second = Rom::mapFile(path);
+  CHECK(first == second);
+  CHECK(Rom::registered() == before + 1);
+  CHECK(memcmp(first->data(), rom, romSize(rom)) == 0);
+  free(rom);
+
+  // A new inode, as an editor or a copy would leave it.
+  unlink(path);
+  rom = aluRom();
+  writeFile(path, rom);
+  Rom* changed = Rom::mapFile(path);
+  CHECK(changed != first);
+  CHECK(memcmp(changed->data(), rom, romSize(rom)) == 0);
+  CHECK(Rom::registered() == before + 2);
+  free(rom);
+  changed->release();
+  second->release();
+  first->release();
+  CHECK(Rom::registered() == before);
+  unlink(path);
+
+  bool threw = false;
+  try {
+    Rom::mapFile(path);
+  } catch (int) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+int main() {
+  sharesContent();
+  borrowedThenOwned();
+  rejectsShort();
+  mapsFiles();
+  return testResult("rom_test");
+}
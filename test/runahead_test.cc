@@ -0,0 +1,76 @@
+#include "gameboy.h"
+
+#include "test.h"
+
+#include <vector>
+
+static std::vector<uint8_t> state(Gameboy* gb) {
+  std::vector<uint8_t> state(gb->stateSize());
+  gb->saveState(state.data(), state.size());
+  return state;
+}
+
+// Run-ahead leaves the machine where a plain frame would, whatever the
+// depth. Idle cycles count only the real frames too; the restore drops
+// decoded code, so the loop is confirmed again and a little less skipped.
+static void matchesPlain() {
+  Gameboy plain(cartridge(pollRom()), 0);
+  for (int i = 0; i < 120; ++i)
+    plain.executeSingleFrame(0xFF);
+  CHECK(plain.idleCycles() != 0);
+  uint64_t idle = 0;
+  for (int frames = 1; frames <= 4; ++frames) {
+    Gameboy ahead(cartridge(pollRom()), 0);
+    for (int i = 0; i < 120; ++i)
+      ahead.runAhead(0xFF, frames);
+    CHECK(ahead.cycles() == plain.cycles());
+    CHECK(ahead.idleCycles() <= plain.idleCycles());
+    CHECK(ahead.idleCycles() > plain.idleCycles() / 2);
+    if (frames == 1)
+      idle = ahead.idleCycles();
+    CHECK(ahead.idleCycles() == idle);
+  }
+}
+
+// After a load, run-ahead must not put back lines from before it.
+static void afterLoad() {
+  Gameboy a(cartridge(vblankRom()), 0);
+  Gameboy b(cartridge(vblankRom()), 0);
+  for (int i = 0; i < 10; ++i)
+    a.executeSingleFrame(0xFF);
+  std::vector<uint8_t> saved = state(&a);
+  for (int i = 0; i < 20; ++i)
+    a.runAhead(i & 4 ? 0xFF : 0xEF, 1);
+  CHECK(a.loadState(saved.data(), saved.size()));
+  CHECK(b.loadState(saved.data(), saved.size()));
+  for (int i = 0; i < 10; ++i) {
+    a.runAhead(0xFF, 1);
+    b.runAhead(0xFF, 1);
+    CHECK(state(&a) == state(&b));
+    CHECK(memcmp(a.frame(), b.frame(), 160 * 144 * 4) == 0);
+  }
+}
+
+// The same after rewinding, which loads a state too.
+static void afterRewind() {
+  Gameboy a(cartridge(vblankRom()), 0);
+  a.setRewind(100, 1 << 20);
+  for (int i = 0; i < 30; ++i)
+    a.runAhead(i & 2 ? 0xFF : 0xDF, 2);
+  CHECK(a.rewind(15) == 15);
+  Gameboy b(cartridge(vblankRom()), 0);
+  std::vector<uint8_t> rewound = state(&a);
+  CHECK(b.loadState(rewound.data(), rewound.size()));
+  for (int i = 0; i < 10; ++i) {
+    a.runAhead(0xFF, 2);
+    b.runAhead(0xFF, 2);
+    CHECK(state(&a) == state(&b));
+  }
+}
+
+int main() {
+  matchesPlain();
+  afterLoad();
+  afterRewind();
+  return testResult("runahead_test");
+}
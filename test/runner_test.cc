@@ -0,0 +1,51 @@
+#include "runner.h"
+
+#include "gameboy.h"
+#include "test.h"
+
+#include <vector>
+
+// Episodes on several ROMs, one of which the core fails on: the others run
+// to the end, and every result is the same whatever the thread count.
+int main() {
+  uint8_t* roms[] = {vblankRom(), pollRom(), batteryRom(), badRom()};
+  std::vector<uint8_t> inputs(300);
+  for (size_t i = 0; i < inputs.size(); ++i)
+    inputs[i] = i % 7 ? 0xFF : 0xEF;
+  std::vector<Runner::Episode> expected;
+  for (int threads : {1, 2, 3, 8}) {
+    std::vector<Runner::Episode> episodes;
+    uint64_t frames = 0;
+    for (int i = 0; i < 24; ++i) {
+      uint8_t* rom = roms[i % 4];
+      int n = 50 + i * 10;
+      episodes.push_back({rom, romSize(rom), n, inputs.data(), 0, 0, false});
+      if (rom != roms[3])
+        frames += n;
+    }
+    Runner runner(threads);
+    runner.run(&episodes);
+    CHECK(runner.frames() == frames);
+    for (size_t i = 0; i < episodes.size(); ++i)
+      CHECK(episodes[i].failed == (episodes[i].rom == roms[3]));
+    if (expected.empty())
+      expected = episodes;
+    for (size_t i = 0; i < episodes.size(); ++i) {
+      CHECK(episodes[i].frameHash == expected[i].frameHash);
+      CHECK(episodes[i].stateHash == expected[i].stateHash);
+    }
+  }
+  // The picture hash is the one a machine hashing every picture ends with.
+  for (size_t e = 0; e < expected.size(); e += 4) {
+    Gameboy gb(cartridge(vblankRom()), 0);
+    gb.setHeadless(true, true, 1);
+    for (int i = 0; i < expected[e].frames; ++i)
+      gb.executeSingleFrame(inputs[i]);
+    CHECK(expected[e].frameHash == gb.frameHash());
+    CHECK(expected[e].frameHash != 0);
+  }
+  CHECK(expected[0].stateHash != expected[4].stateHash);
+  for (uint8_t* rom : roms)
+    free(rom);
+  return testResult("runner_test");
+}
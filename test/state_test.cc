@@ -0,0 +1,75 @@
+#include "gameboy.h"
+
+#include "test.h"
+
+#include <vector>
+
+// Save at a frame, keep running, then load the state into the same and a
+// fresh machine: every later frame must save to the same bytes in both.
+static void roundTrip(uint8_t* (*makeRom)()) {
+  Gameboy a(cartridge(makeRom()), 0);
+  Gameboy b(cartridge(makeRom()), 0);
+  for (int i = 0; i < 30; ++i)
+    a.executeSingleFrame(i & 1 ? 0xEF : 0xFF);
+  std::vector<uint8_t> saved(a.stateSize());
+  CHECK(a.saveState(saved.data(), saved.size()) == saved.size());
+  for (int i = 0; i < 20; ++i)
+    a.executeSingleFrame(0xDF);
+  CHECK(a.loadState(saved.data(), saved.size()));
+  CHECK(b.loadState(saved.data(), saved.size()));
+  std::vector<uint8_t> x(saved.size()), y(saved.size());
+  a.saveState(x.data(), x.size());
+  CHECK(x == saved);
+  for (int i = 0; i < 60; ++i) {
+    a.executeSingleFrame(i % 3 ? 0xFF : 0x7F);
+    b.executeSingleFrame(i % 3 ? 0xFF : 0x7F);
+    a.saveState(x.data(), x.size());
+    b.saveState(y.data(), y.size());
+    CHECK(x == y);
+  }
+  CHECK(x != saved);
+}
+
+// A blob of the wrong size or for another ROM is refused and changes
+// nothing.
+static void rejects() {
+  Gameboy a(cartridge(vblankRom()), 0);
+  Gameboy other(cartridge(aluRom()), 0);
+  a.executeSingleFrame(0xFF);
+  std::vector<uint8_t> before(a.stateSize()), after(a.stateSize());
+  a.saveState(before.data(), before.size());
+  CHECK(!a.loadState(before.data(), before.size() - 1));
+  std::vector<uint8_t> foreign(other.stateSize());
+  other.saveState(foreign.data(), foreign.size());
+  CHECK(!a.loadState(foreign.data(), foreign.size()));
+  CHECK(a.saveState(after.data(), after.size() - 1) == 0);
+  a.saveState(after.data(), after.size());
+  CHECK(before == after);
+}
+
+// Battery RAM goes through states too, and a load marks what it changed.
+static void batteryRam() {
+  Gameboy a(cartridge(batteryRom()), 0);
+  for (int i = 0; i < 5; ++i)
+    a.executeSingleFrame(0xFF);
+  a.takeSaveRanges();
+  std::vector<uint8_t> saved(a.stateSize());
+  a.saveState(saved.data(), saved.size());
+  uint8_t counter = a.peek(0xA000);
+  for (int i = 0; i < 5; ++i)
+    a.executeSingleFrame(0xFF);
+  CHECK(a.peek(0xA000) != counter);
+  a.takeSaveRanges();
+  CHECK(a.loadState(saved.data(), saved.size()));
+  CHECK(a.peek(0xA000) == counter);
+  CHECK(a.saveDirty());
+}
+
+int main() {
+  roundTrip(vblankRom);
+  roundTrip(batteryRom);
+  roundTrip(aluRom);
+  rejects();
+  batteryRam();
+  return testResult("state_test");
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "cartridge.h"
+
+// Shared by the native tests and benchmarks: synthetic ROMs, and a CHECK
+// that reports a failure and carries on, so one run shows all of them.
+
+inline int testFailures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++testFailures;                                                 \
+    }                                                                 \
+  } while (0)
+
+// Exit status of a test's main().
+inline int testResult(const char* name) {
+  fprintf(stderr, "%s: %s\n", name, testFailures ? "FAILED" : "ok");
+  return testFailures != 0;
+}
+
+// A malloc'd ROM image of the size its header gives, with prog at 0x100
+// and RETI on the interrupt vectors. The header checksum bytes are taken
+// from the program, so different programs count as different ROMs.
+inline uint8_t* makeRom(const uint8_t* prog, size_t n, uint8_t type = 0x00, uint8_t romSize = 0, uint8_t ramSize = 0) {
+  size_t size = size_t(0x8000) << romSize;
+  uint8_t* rom = static_cast<uint8_t*>(malloc(size));
+  memset(rom, 0, size);
+  memcpy(rom + 0x100, prog, n);
+  for (int vector = 0x40; vector <= 0x60; vector += 8)
+    rom[vector] = 0xD9;
+  rom[0x147] = type;
+  rom[0x148] = romSize;
+  rom[0x149] = ramSize;
+  uint32_t sum = 0;
+  for (size_t i = 0; i < n; ++i)
+    sum = sum * 31 + prog[i];
+  rom[0x14D] = sum;
+  rom[0x14E] = sum >> 8;
+  rom[0x14F] = sum >> 16;
+  return rom;
+}
+
+inline size_t romSize(const uint8_t* rom) {
+  return size_t(0x8000) << rom[0x148];
+}
+
+// A cartridge owning a ROM from makeRom().
+inline Cartridge cartridge(uint8_t* rom) {
+  return Cartridge(rom, romSize(rom));
+}
+
+// Halts until VBlank, then adds the joypad byte to a counter in HRAM and
+// writes the result to tile data, the tile map, WRAM and SCX. Depends on
+// input, so replays and save states have something to get wrong.
+inline uint8_t* vblankRom() {
+  static const uint8_t PROG[] = {
+      0x31, 0xFE, 0xFF,  // LD SP,FFFE
+      0x3E, 0x01,        // LD A,1
+      0xE0, 0xFF,        // LDH (IE),A
+      0xFB,              // EI
+      0x76,              // 108: HALT
+      0x21, 0x00, 0x80,  // LD HL,8000
+      0xF0, 0x00,        // LDH A,(P1)
+      0x47,              // LD B,A
+      0xF0, 0x80,        // LDH A,(80)
+      0x80,              // ADD A,B
+      0x3C,              // INC A
+      0xE0, 0x80,        // LDH (80),A
+      0x22,              // LD (HL+),A
+      0x77,              // LD (HL),A
+      0xEA, 0x05, 0x98,  // LD (9805),A
+      0xEA, 0x00, 0xC1,  // LD (C100),A
+      0xE0, 0x43,        // LDH (SCX),A
+      0x18, 0xE7,        // JR 108
+  };
+  return makeRom(PROG, sizeof(PROG));
+}
+
+// MBC5 with one bank of battery RAM, whose first byte counts frames.
+inline uint8_t* batteryRom() {
+  static const uint8_t PROG[] = {
+      0x31, 0xFE, 0xFF,  // LD SP,FFFE
+      0x3E, 0x0A,        // LD A,0A
+      0xEA, 0x00, 0x00,  // LD (0000),A: enable RAM
+      0x3E, 0x01,        // LD A,1
+      0xE0, 0xFF,        // LDH (IE),A
+      0xFB,              // EI
+      0x76,              // 10D: HALT
+      0x21, 0x00, 0xA0,  // LD HL,A000
+      0x34,              // INC (HL)
+      0x18, 0xF9,        // JR 10D
+  };
+  return makeRom(PROG, sizeof(PROG), 0x1B, 1, 2);
+}
+
+// ALU and a WRAM store in a tight loop, for the CPU.
+inline uint8_t* aluRom() {
+  static const uint8_t PROG[] = {
+      0x3E, 0x00,        // LD A,0
+      0x06, 0x03,        // LD B,3
+      0x80, 0x90, 0xA0,  // 104: ADD A,B; SUB B; AND B
+      0xB0, 0xA8, 0x3C,  // OR B; XOR B; INC A
+      0x3D, 0xB8,        // DEC A; CP B
+      0xC6, 0x05,        // ADD A,5
+      0xD6, 0x01,        // SUB 1
+      0xEA, 0x00, 0xC0,  // LD (C000),A
+      0x18, 0xEF,        // JR 104
+  };
+  return makeRom(PROG, sizeof(PROG));
+}
+
+// MBC5 with 32 banks; selects one of 16 and reads from it in a loop.
+inline uint8_t* bankRom() {
+  static const uint8_t PROG[] = {
+      0x0E, 0x00,        // LD C,0
+      0x0C,              // 102: INC C
+      0x79,              // LD A,C
+      0xE6, 0x0F,        // AND 0F
+      0xEA, 0x00, 0x20,  // LD (2000),A
+      0xFA, 0x00, 0x40,  // LD A,(4000)
+      0x18, 0xF4,        // JR 102
+  };
+  uint8_t* rom = makeRom(PROG, sizeof(PROG), 0x19, 4);
+  for (int bank = 1; bank < 32; ++bank)
+    rom[bank * 0x4000] = bank;
+  return rom;
+}
+
+// Polls LY for the start of VBlank with interrupts off, then counts frames
+// in HRAM and WRAM and waits for VBlank to end. Both waits are idle loops.
+inline uint8_t* pollRom() {
+  static const uint8_t PROG[] = {
+      0xF0, 0x44,        // 100: LDH A,(LY)
+      0xFE, 0x90,        // CP 90
+      0x20, 0xFA,        // JR NZ,100
+      0xF0, 0x80,        // LDH A,(80)
+      0x3C,              // INC A
+      0xE0, 0x80,        // LDH (80),A
+      0xEA, 0x00, 0xC1,  // LD (C100),A
+      0xF0, 0x44,        // 10E: LDH A,(LY)
+      0xFE, 0x90,        // CP 90
+      0x28, 0xFA,        // JR Z,10E
+      0x18, 0xEA,        // JR 100
+  };
+  return makeRom(PROG, sizeof(PROG));
+}
+
+// Reads an IO register the core does not implement, which throws.
+inline uint8_t* badRom() {
+  static const uint8_t PROG[] = {
+      0x00,        // 100: NOP
+      0xF0, 0x03,  // LDH A,(03)
+      0x18, 0xFB,  // JR 100
+  };
+  return makeRom(PROG, sizeof(PROG));
+}